@@ -2,9 +2,21 @@
  * Created by Ivo Georgiev on 2/9/16.
  */
 
+#define _GNU_SOURCE // MAP_ANONYMOUS, MAP_HUGETLB, MAP_NORESERVE, MADV_HUGEPAGE, clock_gettime, pread
+
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h> // for perror()
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "mem_pool.h"
 
@@ -20,10 +32,49 @@ static const unsigned   MEM_POOL_STORE_EXPAND_FACTOR    = MEM_EXPAND_FACTOR;
 static const unsigned   MEM_NODE_HEAP_INIT_CAPACITY     = 40;
 static const float      MEM_NODE_HEAP_FILL_FACTOR       = MEM_FILL_FACTOR;
 static const unsigned   MEM_NODE_HEAP_EXPAND_FACTOR     = MEM_EXPAND_FACTOR;
+#define MEM_NODE_HEAP_MAX_CHUNKS 32 // more than doubling chunks can reach in an unsigned index
+
+/* TLSF: every power of two is split into 2^MEM_TLSF_SL_LOG2 size classes */
+#define MEM_TLSF_SL_LOG2    5
+#define MEM_TLSF_SL_COUNT   (1 << MEM_TLSF_SL_LOG2)
+#define MEM_TLSF_FL_COUNT   (64 - MEM_TLSF_SL_LOG2 + 1)
+#define MEM_TLSF_PROBES     8   // gaps of the exact class tried as a last resort
+
+/* BUDDY: blocks are powers of two no smaller than 2^MEM_BUDDY_MIN_ORDER */
+#define MEM_BUDDY_MIN_ORDER 4
+#define MEM_BUDDY_ORDERS    64
+
+/* Thread caches: requests up to MEM_TCACHE_CLASSES * MEM_TCACHE_GRANULE
+ * bytes are rounded to a multiple of MEM_TCACHE_GRANULE, one class each */
+#define MEM_TCACHE_GRANULE      16
+#define MEM_TCACHE_CLASSES      64
+#define MEM_TCACHE_BIN_SIZE     16      // blocks kept per class
+#define MEM_TCACHE_FLUSH_OPS    4096    // cache hits between two flushes
+
+/* POOL_HUGE_PAGES: mappings are rounded and aligned to the huge page size */
+#define MEM_HUGE_PAGE_SIZE      ((size_t) 2 << 20)
+
+/* POOL_RESERVE: the committed part of the pool grows by at least this much */
+#define MEM_COMMIT_GRANULE      ((size_t) 64 << 10)
+
+/* Decay: idle time is tracked per granule of this many bytes, or per
+ * huge page in POOL_HUGE_PAGES pools */
+#define MEM_DECAY_GRANULE       ((size_t) 64 << 10)
+#define MEM_GRANULE_LIVE        0   // holds allocated bytes
+#define MEM_GRANULE_IDLE        1   // free, on the idle FIFO of its span
+#define MEM_GRANULE_PURGED      2   // free and given back to the system
+#define MEM_GRANULE_PARKED      3   // free but not committed, POOL_RESERVE
+
+/* Sharded pools: pool_mgr flag, never set by the user */
+#define MEM_POOL_SHARDED        0x100u
 
-static const unsigned   MEM_GAP_IX_INIT_CAPACITY        = 40;
-static const float      MEM_GAP_IX_FILL_FACTOR          = MEM_FILL_FACTOR;
-static const unsigned   MEM_GAP_IX_EXPAND_FACTOR        = MEM_EXPAND_FACTOR;
+/* File-backed pools: pool_mgr flag, never set by the user. The file holds
+ * a header, the pool memory and then the segment table of the last sync,
+ * a snapshot the node list is rebuilt from on open */
+#define MEM_POOL_FILE           0x200u
+#define MEM_FILE_HEADER_SIZE    ((size_t) 4096) // keeps the pool memory page aligned
+#define MEM_FILE_MAGIC          "MEMPOOL1"
+#define MEM_FILE_VERSION        2
 
 
 
@@ -32,22 +83,165 @@ typedef struct _node {
     alloc_t alloc_record;
     unsigned used;
     unsigned allocated;
+    unsigned ix; // position in the node heap, checked by mem_del_alloc
     struct _node *next, *prev; // doubly-linked list for gap deletion
+                               // (unused nodes: next links the free node list)
+    struct _node *gap_left, *gap_right; // gap index tree, keyed by (size, address)
+                                        // or by address for FIRST_FIT
+                                        // (TLSF, BUDDY: prev/next in a free list)
+    int gap_height;
+    size_t gap_max; // largest gap in this subtree of the gap index
+    struct _node *remote_next; // POOL_OWNED: link in the remote-free queue
+    atomic_int handed_out; // POOL_THREAD_CACHE, POOL_OWNED: set while the block is
+                           // the user's, taken back by the free that claims it
 } node_t, *node_pt;
 
-typedef struct _gap {
+typedef int (*gap_cmp_fn)(node_pt a, node_pt b);
+
+struct _pool_mgr;
+
+/*
+ * An allocation policy. mem_new_alloc, mem_del_alloc and mem_inspect_pool
+ * only go through this table, and every policy keeps the index of free
+ * blocks that suits it. A block is what find hands to split and release
+ * hands to coalesce: a node for the node heap policies, a record for SLAB.
+ */
+typedef struct _mem_policy {
+    alloc_status (*open)(struct _pool_mgr *pool_mgr, size_t slot_size); // the whole pool is free
+                                                                    // (sharded: slot_size shards)
+    void (*close)(struct _pool_mgr *pool_mgr);                      // also undoes a failed open
+    void *(*find)(struct _pool_mgr *pool_mgr, size_t size);         // a free block that fits, or NULL
+    alloc_pt (*split)(struct _pool_mgr *pool_mgr, void *block, size_t size);
+    void *(*release)(struct _pool_mgr *pool_mgr, alloc_pt alloc);   // NULL if alloc is not live here
+    alloc_status (*coalesce)(struct _pool_mgr *pool_mgr, void *block);
+    unsigned (*inspect)(struct _pool_mgr *pool_mgr, pool_segment_pt segs); // segs NULL: count only
+    void (*add_gap)(struct _pool_mgr *pool_mgr, node_pt node);      // gap index of node heap policies
+    void (*remove_gap)(struct _pool_mgr *pool_mgr, node_pt node);
+    int lock_free; // safe to call concurrently, POOL_THREAD_SAFE pools skip their lock
+    alloc_status (*split_run)(struct _pool_mgr *pool_mgr, void *block, // carves back-to-back
+                              const size_t *sizes, alloc_pt *allocs, unsigned num); // allocations
+    alloc_status (*coalesce_run)(struct _pool_mgr *pool_mgr, void **blocks, // released blocks
+                                 unsigned num);                              // in address order
+    alloc_status (*resize)(struct _pool_mgr *pool_mgr, alloc_pt alloc, size_t size); // in place:
+                          // ALLOC_FAIL if alloc is not live here, ALLOC_NOT_FREED if it stays as is
+    void *(*find_aligned)(struct _pool_mgr *pool_mgr, size_t size, // like find, for a block
+                          size_t alignment);                       // at an aligned address
+} mem_policy_t;
+
+typedef struct _tlsf {
+    unsigned long long fl_bitmap;               // bit f set if any list of row f is non-empty
+    unsigned sl_bitmap[MEM_TLSF_FL_COUNT];      // bit s set if heads[f][s] is non-empty
+    node_pt heads[MEM_TLSF_FL_COUNT][MEM_TLSF_SL_COUNT];
+} tlsf_t, *tlsf_pt;
+
+typedef struct _slab {
+    size_t slot_size;           // obj_size rounded up to hold a free list link
+    size_t num_slots;
+    alloc_pt records;           // one allocation record per slot, never moves
+    unsigned char *allocated;   // 1 if the slot is handed out
+    size_t free_head;           // first slot of the free list, num_slots if empty
+    size_t fresh;               // slots from here on were never handed out
+    _Atomic uint64_t lf_head;   // lock-free: (ABA tag << 32) | first free slot
+    _Atomic uint32_t *lf_links; // lock-free: the free slot after each free slot
+    atomic_uchar *lf_allocated; // lock-free: replaces allocated
+} slab_t, *slab_pt;
+
+typedef struct _buddy {
+    unsigned long long order_bitmap;            // bit k set if heads[k] is non-empty
+    node_pt heads[MEM_BUDDY_ORDERS];            // free blocks of size 2^k
+} buddy_t, *buddy_pt;
+
+typedef struct _granule {
+    size_t live;                    // allocated bytes in the granule
+    unsigned long long idle_since;  // when live dropped to 0, in ms
+    size_t idle_next, idle_prev;    // idle FIFO, oldest first; num_granules ends it
+    unsigned char state;            // MEM_GRANULE_*
+} granule_t, *granule_pt;
+
+typedef struct _decay {
+    char *mem;                      // the region the span covers
+    size_t size;
+    char *base;                     // its first whole granule
+    size_t num_granules;            // whole granules in the region
+    granule_pt granules;
+    size_t idle_head, idle_tail;    // num_granules while the FIFO is empty
+    struct _decay *next;            // the span of another region
+} decay_t, *decay_pt;
+
+typedef struct _region {
+    char *mem;
     size_t size;
+    size_t map_size;            // as for the first region, see _mem_pool_map
+    struct _region *next;
+} region_t, *region_pt;
+
+typedef struct _file_header {
+    char magic[8];          // MEM_FILE_MAGIC, not NUL terminated
+    uint32_t version;
+    uint32_t policy;
+    uint64_t size;          // of the pool memory, right after the header
+    uint64_t num_segments;  // in the segment table, as of the last sync
+    uint64_t table_at;      // file offset of that table; both change in one write
+} file_header_t, *file_header_pt;
+
+typedef struct _file_segment {
+    uint64_t offset;        // from the start of the pool memory
+    uint64_t size;
+    uint64_t allocated;
+} file_segment_t, *file_segment_pt;
+
+typedef struct _file_alloc {
+    char *mem;              // where the allocation started when the file was opened
     node_pt node;
-} gap_t, *gap_pt;
+} file_alloc_t, *file_alloc_pt;
+
+typedef struct _tcache {
+    struct _pool_mgr *pool_mgr;
+    unsigned long long pool_id;     // pool ids are never reused, pool_mgr addresses are
+    struct _tcache *next_in_pool;   // the caches of one pool, under its lock
+    struct _tcache *next_in_thread; // the caches of one thread
+    int detached;                   // the pool was closed, under pool_store_lock
+    unsigned ops;                   // cache hits since the last flush
+    unsigned count[MEM_TCACHE_CLASSES];
+    alloc_pt bins[MEM_TCACHE_CLASSES][MEM_TCACHE_BIN_SIZE]; // LIFO, newest last
+} tcache_t, *tcache_pt;
 
 typedef struct _pool_mgr {
     pool_t pool;
-    node_pt node_heap;
+    const mem_policy_t *policy;
+    node_pt node_heap[MEM_NODE_HEAP_MAX_CHUNKS]; // node chunks, published with a release
+                                                // store; nodes never move once handed out
+    unsigned node_heap_chunks;
     unsigned total_nodes;
     unsigned used_nodes;
-    gap_pt gap_ix;
-    unsigned gap_ix_capacity;
-    unsigned gap_ix_size;
+    node_pt free_nodes; // LIFO list of unused nodes, linked through next
+    node_pt gap_ix; // root of the balanced gap index tree
+    node_pt rover;  // NEXT_FIT: where the next search starts, NULL for the first node
+    tlsf_pt tlsf;   // segregated free lists, replaces gap_ix for TLSF pools
+    buddy_pt buddy; // per-order free lists, replaces gap_ix for BUDDY pools
+    slab_pt slab;   // equal-sized slots, replaces the node heap for SLAB pools
+    unsigned flags; // POOL_* flags the pool was opened with
+    pthread_mutex_t lock; // POOL_THREAD_SAFE: held while the pool is changed or inspected
+    unsigned long long id; // unique for the life of the program
+    tcache_pt tcaches; // POOL_THREAD_CACHE: the thread caches of this pool
+    pthread_t owner; // POOL_OWNED: the thread that opened the pool
+    _Atomic(node_pt) remote_frees; // POOL_OWNED: LIFO of blocks freed by other threads
+    struct _pool_mgr *parent; // shards: the sharded pool whose memory they carve
+    struct _pool_mgr **shards; // sharded pools: their shards, in address order
+    unsigned num_shards;
+    size_t shard_size; // at open, every shard but the last, which takes the rest
+    size_t map_size; // POOL_HUGE_PAGES, POOL_RESERVE: length of the mapping behind pool.mem
+    long decay_ms; // how long a granule stays free before it is purged, < 0 never
+    decay_pt decay; // decay: one span per region, NULL while decay is off
+    _Atomic(region_pt) regions; // POOL_GROWABLE: the regions after the first one, newest
+                                // first; published with a release store, never removed
+    size_t first_size; // the first region, at pool.mem; total_size counts all of them
+    node_pt head; // first node of the node list, NULL in a shard that gave away all its memory
+    node_pt tail; // last node of the node list, where _mem_pool_grow appends
+    size_t max_size; // POOL_GROWABLE: total_size never grows past this
+    int file_fd; // file-backed pools: the file mapped behind pool.mem, -1 for others
+    file_alloc_pt file_allocs; // file-backed pools: the allocations the file held, by address
+    unsigned num_file_allocs;
 } pool_mgr_t, *pool_mgr_pt;
 
 
@@ -55,12 +249,38 @@ typedef struct _pool_mgr {
 static pool_mgr_pt *pool_store = NULL; // an array of pointers, only expand
 static unsigned pool_store_size = 0;
 static unsigned pool_store_capacity = 0;
+static unsigned long long pool_store_next_id = 0;
+static pthread_mutex_t pool_store_lock = PTHREAD_MUTEX_INITIALIZER; // guards the four above
+                                                                    // and is taken before a pool lock
+static atomic_uint thread_tickets = 0;              // hands out home shards round robin
+static _Thread_local unsigned thread_ticket = 0;     // this thread's ticket + 1, 0 if none yet
+static _Thread_local tcache_pt thread_caches = NULL; // this thread's caches, of all pools
+static pthread_key_t thread_caches_key;              // flushes them when the thread exits
+static pthread_once_t thread_caches_once = PTHREAD_ONCE_INIT;
 
 
 /* Forward declarations of static functions */
+static alloc_status _mem_init_pool_store();
 static alloc_status _mem_resize_pool_store();
+static void _mem_remove_from_pool_store(pool_mgr_pt pool_mgr);
+static void _mem_pool_lock(pool_mgr_pt pool_mgr);
+static void _mem_pool_unlock(pool_mgr_pt pool_mgr);
+static unsigned _mem_tcache_class(size_t size);
+static tcache_pt _mem_tcache_get(pool_mgr_pt pool_mgr);
+static alloc_pt _mem_tcache_pop(tcache_pt tcache, size_t size);
+static alloc_status _mem_tcache_push(tcache_pt tcache, alloc_pt alloc);
+static void _mem_nodes_handout(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static void _mem_tcache_detach_all(pool_mgr_pt pool_mgr);
+static alloc_status _mem_remote_push(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_remote_drain(pool_mgr_pt pool_mgr);
 static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr);
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr);
+static node_pt _mem_node_at(pool_mgr_pt pool_mgr, unsigned ix);
+static unsigned long long _mem_now_ms();
+static alloc_status _mem_decay_open(pool_mgr_pt pool_mgr);
+static void _mem_decay_close(pool_mgr_pt pool_mgr);
+static alloc_status _mem_decay_span(pool_mgr_pt pool_mgr, char *mem, size_t size);
+static void _mem_decay_live(pool_mgr_pt pool_mgr, const char *mem, size_t size, int add);
+static void _mem_decay_purge(pool_mgr_pt pool_mgr);
 static alloc_status
         _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
                            size_t size,
@@ -69,7 +289,150 @@ static alloc_status
         _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
                                 size_t size,
                                 node_pt node);
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
+static pool_pt _mem_pool_open(size_t size, alloc_policy policy, size_t slot_size,
+                              unsigned flags, char *mem);
+static pool_mgr_pt _mem_pool_create(size_t size, alloc_policy policy, size_t slot_size,
+                                    unsigned flags, pool_mgr_pt parent, char *mem);
+static void _mem_pool_destroy(pool_mgr_pt pool_mgr);
+static char *_mem_pool_map(pool_mgr_pt pool_mgr, size_t size, size_t *map_size);
+static void _mem_pool_unmap(char *mem, size_t map_size);
+static alloc_status _mem_pool_grow(pool_mgr_pt pool_mgr, size_t size);
+static void *_mem_pool_find(pool_mgr_pt pool_mgr, size_t size);
+static alloc_status _mem_pool_commit(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_pt _mem_pool_commit_or_undo(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static off_t _mem_file_table_at(size_t size);
+static alloc_status _mem_file_load(pool_mgr_pt pool_mgr, int fd, const file_header_t *header);
+static alloc_status _mem_file_sync(pool_mgr_pt pool_mgr);
+static node_pt _mem_acquire_node(pool_mgr_pt pool_mgr);
+static void _mem_release_node(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_nodes_track_tail(pool_mgr_pt pool_mgr, node_pt node);
+/* shared by the policies that carve gaps out of the node list */
+static alloc_status _mem_nodes_open(pool_mgr_pt pool_mgr, size_t slot_size);
+static void _mem_nodes_close(pool_mgr_pt pool_mgr);
+static alloc_pt _mem_nodes_split(pool_mgr_pt pool_mgr, void *block, size_t size);
+static alloc_status _mem_nodes_split_run(pool_mgr_pt pool_mgr, void *block,
+                                         const size_t *sizes, alloc_pt *allocs, unsigned num);
+static void *_mem_nodes_release(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_status _mem_nodes_coalesce(pool_mgr_pt pool_mgr, void *block);
+static alloc_status _mem_nodes_coalesce_run(pool_mgr_pt pool_mgr, void **blocks, unsigned num);
+static int _mem_block_cmp_address(const void *a, const void *b);
+static node_pt _mem_nodes_live(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static node_pt _mem_nodes_claim(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static int _mem_nodes_adjacent(node_pt node, node_pt next);
+static alloc_status _mem_nodes_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size);
+static size_t _mem_align_pad(const char *mem, size_t alignment);
+static void *_mem_nodes_find_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+static void *_mem_nodes_align_gap(pool_mgr_pt pool_mgr, node_pt gap, size_t alignment);
+static unsigned _mem_nodes_inspect(pool_mgr_pt pool_mgr, pool_segment_pt segs);
+static alloc_status _mem_nodes_rebuild(pool_mgr_pt pool_mgr, const pool_segment_t *segs, unsigned num);
+/* FIRST_FIT, BEST_FIT: balanced gap index tree */
+static int _mem_gap_cmp(node_pt a, node_pt b);
+static int _mem_gap_cmp_address(node_pt a, node_pt b);
+static node_pt _mem_gap_ix_insert(node_pt root, node_pt node, gap_cmp_fn cmp);
+static node_pt _mem_gap_ix_remove(node_pt root, node_pt node, gap_cmp_fn cmp);
+static void _mem_ff_add_gap(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_ff_remove_gap(pool_mgr_pt pool_mgr, node_pt node);
+static void *_mem_gap_ix_first_fit(pool_mgr_pt pool_mgr, size_t size);
+static void _mem_bf_add_gap(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_bf_remove_gap(pool_mgr_pt pool_mgr, node_pt node);
+static void *_mem_gap_ix_best_fit(pool_mgr_pt pool_mgr, size_t size);
+/* NEXT_FIT: no index */
+static void _mem_no_gap_ix(pool_mgr_pt pool_mgr, node_pt node);
+static void *_mem_next_fit(pool_mgr_pt pool_mgr, size_t size);
+/* TLSF: segregated free lists */
+static alloc_status _mem_tlsf_open(pool_mgr_pt pool_mgr, size_t slot_size);
+static void _mem_tlsf_close(pool_mgr_pt pool_mgr);
+static void _mem_tlsf_insert(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_tlsf_remove(pool_mgr_pt pool_mgr, node_pt node);
+static void *_mem_tlsf_find(pool_mgr_pt pool_mgr, size_t size);
+/* BUDDY: per-order free lists */
+static alloc_status _mem_buddy_open(pool_mgr_pt pool_mgr, size_t slot_size);
+static void _mem_buddy_close(pool_mgr_pt pool_mgr);
+static void _mem_buddy_insert(pool_mgr_pt pool_mgr, node_pt node);
+static void _mem_buddy_remove(pool_mgr_pt pool_mgr, node_pt node);
+static void *_mem_buddy_find(pool_mgr_pt pool_mgr, size_t size);
+static alloc_pt _mem_buddy_split(pool_mgr_pt pool_mgr, void *block, size_t size);
+static alloc_status _mem_buddy_coalesce(pool_mgr_pt pool_mgr, void *block);
+static alloc_status _mem_buddy_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size);
+static void *_mem_buddy_find_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+/* SLAB: equal-sized slots */
+static alloc_status _mem_slab_open(pool_mgr_pt pool_mgr, size_t slot_size);
+static void _mem_slab_close(pool_mgr_pt pool_mgr);
+static void *_mem_slab_find(pool_mgr_pt pool_mgr, size_t size);
+static alloc_pt _mem_slab_split(pool_mgr_pt pool_mgr, void *block, size_t size);
+static void *_mem_slab_release(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_status _mem_slab_coalesce(pool_mgr_pt pool_mgr, void *block);
+static unsigned _mem_slab_inspect(pool_mgr_pt pool_mgr, pool_segment_pt segs);
+static size_t _mem_slab_ix(slab_pt slab, alloc_pt alloc);
+static alloc_status _mem_slab_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size);
+static void *_mem_slab_find_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+/* SLAB, POOL_THREAD_SAFE: lock-free free list of slots */
+static alloc_status _mem_slab_lf_open(pool_mgr_pt pool_mgr, size_t slot_size);
+static void *_mem_slab_lf_find(pool_mgr_pt pool_mgr, size_t size);
+static alloc_pt _mem_slab_lf_split(pool_mgr_pt pool_mgr, void *block, size_t size);
+static void *_mem_slab_lf_release(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_status _mem_slab_lf_coalesce(pool_mgr_pt pool_mgr, void *block);
+static unsigned _mem_slab_lf_inspect(pool_mgr_pt pool_mgr, pool_segment_pt segs);
+static alloc_status _mem_slab_lf_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size);
+/* sharded pools: a pool of POOL_THREAD_SAFE pools */
+static alloc_status _mem_shards_open(pool_mgr_pt pool_mgr, size_t num_shards);
+static void _mem_shards_close(pool_mgr_pt pool_mgr);
+static void *_mem_shards_find(pool_mgr_pt pool_mgr, size_t size);
+static alloc_pt _mem_shards_split(pool_mgr_pt pool_mgr, void *block, size_t size);
+static void *_mem_shards_release(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_status _mem_shards_coalesce(pool_mgr_pt pool_mgr, void *block);
+static unsigned _mem_shards_inspect(pool_mgr_pt pool_mgr, pool_segment_pt segs);
+static pool_mgr_pt _mem_shards_of(pool_mgr_pt pool_mgr, alloc_pt alloc);
+static alloc_status _mem_shards_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size);
+static void *_mem_shards_find_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+static alloc_pt _mem_shards_join(pool_mgr_pt pool_mgr, size_t size, size_t alignment);
+static void _mem_shards_move(pool_mgr_pt pool_mgr, unsigned first, unsigned last, size_t size);
+static void _mem_shards_lock_all(pool_mgr_pt pool_mgr);
+static void _mem_shards_unlock_all(pool_mgr_pt pool_mgr);
+
+
+/* The policies, indexed by alloc_policy */
+static const mem_policy_t MEM_POLICIES[] = {
+    [FIRST_FIT] = { _mem_nodes_open, _mem_nodes_close, _mem_gap_ix_first_fit, _mem_nodes_split,
+                    _mem_nodes_release, _mem_nodes_coalesce, _mem_nodes_inspect,
+                    _mem_ff_add_gap, _mem_ff_remove_gap, 0, _mem_nodes_split_run, _mem_nodes_coalesce_run,
+                    _mem_nodes_resize, _mem_nodes_find_aligned },
+    [BEST_FIT]  = { _mem_nodes_open, _mem_nodes_close, _mem_gap_ix_best_fit, _mem_nodes_split,
+                    _mem_nodes_release, _mem_nodes_coalesce, _mem_nodes_inspect,
+                    _mem_bf_add_gap, _mem_bf_remove_gap, 0, _mem_nodes_split_run, _mem_nodes_coalesce_run,
+                    _mem_nodes_resize, _mem_nodes_find_aligned },
+    [TLSF]      = { _mem_tlsf_open, _mem_tlsf_close, _mem_tlsf_find, _mem_nodes_split,
+                    _mem_nodes_release, _mem_nodes_coalesce, _mem_nodes_inspect,
+                    _mem_tlsf_insert, _mem_tlsf_remove, 0, _mem_nodes_split_run, _mem_nodes_coalesce_run,
+                    _mem_nodes_resize, _mem_nodes_find_aligned },
+    [BUDDY]     = { _mem_buddy_open, _mem_buddy_close, _mem_buddy_find, _mem_buddy_split,
+                    _mem_nodes_release, _mem_buddy_coalesce, _mem_nodes_inspect,
+                    _mem_buddy_insert, _mem_buddy_remove, 0, NULL, NULL, _mem_buddy_resize,
+                    _mem_buddy_find_aligned },
+    [SLAB]      = { _mem_slab_open, _mem_slab_close, _mem_slab_find, _mem_slab_split,
+                    _mem_slab_release, _mem_slab_coalesce, _mem_slab_inspect,
+                    NULL, NULL, 0, NULL, NULL, _mem_slab_resize,
+                    _mem_slab_find_aligned },
+    [NEXT_FIT]  = { _mem_nodes_open, _mem_nodes_close, _mem_next_fit, _mem_nodes_split,
+                    _mem_nodes_release, _mem_nodes_coalesce, _mem_nodes_inspect,
+                    _mem_no_gap_ix, _mem_no_gap_ix, 0, _mem_nodes_split_run, _mem_nodes_coalesce_run,
+                    _mem_nodes_resize, _mem_nodes_find_aligned },
+};
+static const unsigned MEM_NUM_POLICIES = sizeof(MEM_POLICIES) / sizeof(MEM_POLICIES[0]);
+
+/* SLAB pools opened with POOL_THREAD_SAFE */
+static const mem_policy_t MEM_SLAB_LOCK_FREE =
+                  { _mem_slab_lf_open, _mem_slab_close, _mem_slab_lf_find, _mem_slab_lf_split,
+                    _mem_slab_lf_release, _mem_slab_lf_coalesce, _mem_slab_lf_inspect,
+                    NULL, NULL, 1, NULL, NULL, _mem_slab_lf_resize,
+                    _mem_slab_find_aligned };
+
+/* Pools opened with mem_pool_open_sharded, the shards lock themselves */
+static const mem_policy_t MEM_SHARDED =
+                  { _mem_shards_open, _mem_shards_close, _mem_shards_find, _mem_shards_split,
+                    _mem_shards_release, _mem_shards_coalesce, _mem_shards_inspect,
+                    NULL, NULL, 1, NULL, NULL, _mem_shards_resize,
+                    _mem_shards_find_aligned };
 
 
 /* Definitions of user-facing functions */
@@ -88,45 +451,44 @@ static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr);
 */
 alloc_status mem_init() {
 
+	pthread_mutex_lock(&pool_store_lock);
 	//If the pool store already has been initialized
 	//Return the allocation status stating that it already has been initialized.
-	if (pool_store != NULL){
-		return ALLOC_CALLED_AGAIN;
-	}
-	//Allocate room for the initial amount pool store capacity
-	pool_store = (pool_mgr_pt *)calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(pool_mgr_t));
-	//If our allocation went correctly
-	if (pool_store != NULL){
-		//Set the size and capacity of the pool store
-		pool_store_size = MEM_POOL_STORE_INIT_CAPACITY;
-
-		return ALLOC_OK;
+	alloc_status status = ALLOC_CALLED_AGAIN;
+	if (pool_store == NULL){
+		status = _mem_init_pool_store();
 	}
-    //If we get to this point then we know an allocation failed
-	return ALLOC_FAIL;
+	pthread_mutex_unlock(&pool_store_lock);
+	return status;
 }
 
 alloc_status mem_free() {
     
+	pthread_mutex_lock(&pool_store_lock);
 	/* If mem_init hasn't been called yell at things. */
 	if (pool_store == NULL){
+		pthread_mutex_unlock(&pool_store_lock);
 		return ALLOC_CALLED_AGAIN;
 	}
-	/* for all initialized pool managers */
-	for (unsigned int i = 0; i < pool_store_capacity; ++i){
-		/* delete the memory of the poolmgr */
-		mem_pool_close(&pool_store[i]->pool);
+	/* for all pool managers that are still open */
+	while (pool_store_capacity > 0){
+		pool_mgr_pt manager = pool_store[pool_store_capacity - 1];
+		/* delete the memory of the poolmgr, a pool that still has
+		 * allocations is left to its owner but leaves the store */
+		_mem_remove_from_pool_store(manager);
+		_mem_tcache_detach_all(manager);
+		_mem_remote_drain(manager);
+		if (manager->pool.num_allocs == 0 || (manager->flags & MEM_POOL_FILE)){
+			_mem_pool_destroy(manager);
+		}
 	}
 	/* free the memory allocated */
 	free(pool_store);
     pool_store = NULL;
-	if (pool_store != NULL){
-		/* If the deallocation failed return a failure */
-		return ALLOC_FAIL;
-	}
 	/* reset static variables */
 	pool_store_capacity = 0;
 	pool_store_size = 0;
+	pthread_mutex_unlock(&pool_store_lock);
 	return ALLOC_OK;
 }
 
@@ -135,15 +497,210 @@ alloc_status mem_free() {
  * Passed Variables: size_t size, alloc_policy policy
  * Return Type: pool_pt
  * Purpose: This function creates a new pool of memory of the passed size.
+ * SLAB pools need a slot size and are refused here, they are opened
+ * with mem_pool_open_slab.
+ */
+pool_pt mem_pool_open(size_t size, alloc_policy policy) {
+    return mem_pool_open_flags(size, policy, 0);
+}
+
+/*
+ * Function Name: mem_pool_open_flags
+ * Passed Variables: size_t size, alloc_policy policy, unsigned flags
+ * Return Type: pool_pt
+ * Purpose: Works like mem_pool_open. With POOL_THREAD_SAFE in flags the
+ * pool gets a lock of its own, which mem_new_alloc, mem_del_alloc and
+ * mem_inspect_pool hold while they work on it, so the pool can be shared
+ * between threads. Pools without the flag pay nothing for it.
+ * POOL_THREAD_CACHE implies POOL_THREAD_SAFE and puts a cache of freed
+ * small blocks in front of the lock, one per thread and size class.
+ * POOL_OWNED pools take no lock at all: only the opening thread allocates
+ * from them, while blocks freed by other threads are queued with a single
+ * atomic push and taken back by the owner on its next allocation.
+ * POOL_HUGE_PAGES maps the pool instead of malloc'ing it, aligned to 2 MiB
+ * and on huge pages: explicit ones if the system has them reserved,
+ * transparent ones otherwise.
+ * POOL_RESERVE only reserves the address range of the pool and commits it
+ * from the start on as the highest allocated address grows; the pool's
+ * committed_size tells how much is backed by memory.
+ * POOL_GROWABLE pools add a region of memory when no gap can serve a
+ * request, at least as large as the pool so far, up to the size set with
+ * mem_pool_set_max_size. BUDDY pools cannot grow.
+ */
+pool_pt mem_pool_open_flags(size_t size, alloc_policy policy, unsigned flags) {
+    if (policy == SLAB){
+        return NULL;
+    }
+    if ((flags & POOL_RESERVE) && (flags & (POOL_HUGE_PAGES | POOL_GROWABLE))){
+        return NULL;
+    }
+    if ((flags & POOL_GROWABLE) && policy == BUDDY){
+        return NULL;
+    }
+    if (flags & POOL_THREAD_CACHE){
+        flags |= POOL_THREAD_SAFE;
+    }
+    if ((flags & POOL_OWNED) && (flags & POOL_THREAD_SAFE)){
+        return NULL;
+    }
+    return _mem_pool_open(size, policy, 0, flags, NULL);
+}
+
+/*
+ * Function Name: mem_pool_open_sharded
+ * Passed Variables: size_t size, alloc_policy policy, unsigned num_shards
+ * Return Type: pool_pt
+ * Purpose: This function creates a pool of the passed size that is split
+ * into num_shards POOL_THREAD_SAFE pools of the passed policy, so that
+ * threads allocating at the same time mostly take different locks. Every
+ * thread allocates from its home shard first and only moves on to the
+ * other shards when that one cannot serve the request, and a request no
+ * shard can serve takes free memory across shard borders, which then
+ * stays with the shard it starts in. Allocations are freed into the
+ * shard they came from, found from their address.
+ */
+pool_pt mem_pool_open_sharded(size_t size, alloc_policy policy, unsigned num_shards) {
+    if (policy == SLAB || num_shards == 0 || size / num_shards == 0){
+        return NULL;
+    }
+    return _mem_pool_open(size, policy, num_shards, MEM_POOL_SHARDED, NULL);
+}
+
+/*
+ * Function Name: mem_pool_open_slab
+ * Passed Variables: size_t obj_size, size_t count
+ * Return Type: pool_pt
+ * Purpose: This function creates a pool of count equal-sized slots. The
+ * slot size is obj_size rounded up to a multiple of sizeof(size_t), since
+ * a free slot holds the link of the free list. Allocations are served
+ * from that free list in O(1) and need no node in the node heap.
+ */
+pool_pt mem_pool_open_slab(size_t obj_size, size_t count) {
+    return mem_pool_open_slab_flags(obj_size, count, 0);
+}
+
+/*
+ * Function Name: mem_pool_open_slab_flags
+ * Passed Variables: size_t obj_size, size_t count, unsigned flags
+ * Return Type: pool_pt
+ * Purpose: Works like mem_pool_open_slab. POOL_THREAD_SAFE is the only
+ * flag a slab pool takes, and it needs no lock: the free slots form a
+ * lock-free stack, so any number of threads can allocate and free at
+ * once. Such a pool has at most 2^32 - 2 slots. POOL_HUGE_PAGES works as
+ * for mem_pool_open_flags.
+ */
+pool_pt mem_pool_open_slab_flags(size_t obj_size, size_t count, unsigned flags) {
+    if (obj_size == 0 || count == 0 || (flags & ~(POOL_THREAD_SAFE | POOL_HUGE_PAGES)) != 0){
+        return NULL;
+    }
+    if ((flags & POOL_THREAD_SAFE) && count >= UINT32_MAX){
+        return NULL;
+    }
+    size_t slot_size = (obj_size + sizeof(size_t) - 1) / sizeof(size_t) * sizeof(size_t);
+    if (slot_size < obj_size || count > (size_t) -1 / slot_size){
+        return NULL;
+    }
+    return _mem_pool_open(slot_size * count, SLAB, slot_size, flags, NULL);
+}
+
+/*
+ * Function Name: mem_pool_open_file
+ * Passed Variables: const char *path, size_t size, alloc_policy policy
+ * Return Type: pool_pt
+ * Purpose: This function creates a pool of the passed size whose memory
+ * is the file at path, mapped shared, together with a snapshot of its
+ * allocations and gaps taken at every mem_pool_sync and mem_pool_close.
+ * A missing or empty file is set up as a new pool. An existing one is
+ * opened again as of its last snapshot: the node list and gap index are
+ * rebuilt from it, which takes time in the number of segments, and
+ * whatever was allocated or freed after it is forgotten, though the
+ * memory keeps any later writes. It must have been made with the same
+ * policy, and size must be its size or 0. Allocation records are not
+ * kept in the file: allocations are found again from their offsets with
+ * mem_alloc_at. Only FIRST_FIT, BEST_FIT, TLSF and NEXT_FIT pools can be
+ * backed by a file, and they take no flags.
+ */
+pool_pt mem_pool_open_file(const char *path, size_t size, alloc_policy policy) {
+    if (path == NULL || (policy != FIRST_FIT && policy != BEST_FIT &&
+                         policy != TLSF && policy != NEXT_FIT)){
+        return NULL;
+    }
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0){
+        return NULL;
+    }
+    file_header_t header;
+    struct stat st;
+    int ok = fstat(fd, &st) == 0;
+    if (ok && st.st_size == 0){
+        //a new file, its segment table is written on the first sync
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, MEM_FILE_MAGIC, sizeof(header.magic));
+        header.version = MEM_FILE_VERSION;
+        header.policy = (uint32_t) policy;
+        header.size = size;
+        ok = size > 0 && _mem_file_table_at(size) > 0 &&
+             ftruncate(fd, (off_t) (MEM_FILE_HEADER_SIZE + size)) == 0;
+    }
+    else if (ok){
+        ok = pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+             memcmp(header.magic, MEM_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+             header.version == MEM_FILE_VERSION && header.policy == (uint32_t) policy &&
+             header.size > 0 && (size == 0 || size == header.size);
+        size = (size_t) header.size;
+        ok = ok && _mem_file_table_at(size) > 0 &&
+             (uint64_t) st.st_size >= MEM_FILE_HEADER_SIZE + header.size;
+    }
+    char *map = ok ? mmap(NULL, MEM_FILE_HEADER_SIZE + size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED){
+        close(fd);
+        return NULL;
+    }
+    memcpy(map, &header, sizeof(header));
+
+    pool_mgr_pt manager = (pool_mgr_pt) _mem_pool_open(size, policy, 0, MEM_POOL_FILE,
+                                                       map + MEM_FILE_HEADER_SIZE);
+    if (manager != NULL && _mem_file_load(manager, fd, &header) != ALLOC_OK){
+        //file_fd is not set yet, so the half loaded pool is not synced
+        pthread_mutex_lock(&pool_store_lock);
+        _mem_remove_from_pool_store(manager);
+        pthread_mutex_unlock(&pool_store_lock);
+        _mem_pool_destroy(manager);
+        manager = NULL;
+    }
+    if (manager == NULL){
+        munmap(map, MEM_FILE_HEADER_SIZE + size);
+        close(fd);
+        return NULL;
+    }
+    (*manager).file_fd = fd;
+    return (pool_pt) manager;
+}
+
+/*
+ * Function Name: _mem_pool_open
+ * Passed Variables: size_t size, alloc_policy policy, size_t slot_size,
+ *                   unsigned flags, char *mem
+ * Return Type: pool_pt
+ * Purpose: This function creates a new pool of memory of the passed size.
  * This is put into a new pool_mgr that has all of it's default values set.
  * The pool's default values are also set. These default values are set using
- * constant value specified at the start of the file.
+ * constant value specified at the start of the file. slot_size is only
+ * used by SLAB pools. mem is the memory of the pool, or NULL to allocate it.
  */
-pool_pt mem_pool_open(size_t size, alloc_policy policy) {
+static pool_pt _mem_pool_open(size_t size, alloc_policy policy, size_t slot_size,
+                              unsigned flags, char *mem) {
+    // Only the policies in the policy table can be opened
+    if ((unsigned) policy >= MEM_NUM_POLICIES){
+        return NULL;
+    }
+	pthread_mutex_lock(&pool_store_lock);
     // If the array of pool stores hasn't been allocated then allocate it.
 	if (pool_store == NULL){
 		//if the memory fails to allocate then return NULL.
-		if (mem_init() == ALLOC_FAIL){
+		if (_mem_init_pool_store() == ALLOC_FAIL){
+			pthread_mutex_unlock(&pool_store_lock);
 			return NULL;
 		}
 	}
@@ -151,9 +708,35 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy) {
 	//CHeck to see if we have the maximum amount of pool_stores or not.
 	if (_mem_resize_pool_store() != ALLOC_OK){
         pool_store_capacity--;
+		pthread_mutex_unlock(&pool_store_lock);
 		return NULL;//IF it fails then return NULL.
 	}
 
+	pool_mgr_pt manager = _mem_pool_create(size, policy, slot_size, flags, NULL, mem);
+	if (manager == NULL){
+		//Restore these states to their pre function states.
+		pool_store_capacity--;
+		pthread_mutex_unlock(&pool_store_lock);
+		return NULL;
+	}
+	pool_store[pool_store_capacity - 1] = manager;//Place the new pool in the next open place of the pool_store array.
+	pthread_mutex_unlock(&pool_store_lock);
+
+    return (pool_pt) manager;
+}
+
+/*
+ * Function Name: _mem_pool_create
+ * Passed Variables: size_t size, alloc_policy policy, size_t slot_size,
+ *                   unsigned flags, pool_mgr_pt parent, char *mem
+ * Return Type: pool_mgr_pt
+ * Purpose: Sets up a pool manager that is not in the pool store. Its
+ * memory is mem, which belongs to the parent pool or to the file of a
+ * MEM_POOL_FILE pool, or is allocated here if mem is NULL. The caller
+ * holds pool_store_lock.
+ */
+static pool_mgr_pt _mem_pool_create(size_t size, alloc_policy policy, size_t slot_size,
+                                    unsigned flags, pool_mgr_pt parent, char *mem) {
     int bool = 0;
     pool_mgr_pt manager = NULL;
     /* Loop until allocation succeeds */
@@ -165,276 +748,827 @@ pool_pt mem_pool_open(size_t size, alloc_policy policy) {
         }
     }
 
-	pool_store[pool_store_capacity - 1] = manager;//Place the new pool in the next open place of the pool_store array.
 	//Set pools values
 	(*manager).pool.policy = policy;
 	(*manager).pool.total_size = size;
-	(*manager).pool.mem = malloc(size);
+	(*manager).first_size = size;
+	(*manager).parent = parent;
+	(*manager).flags = flags;
+	(*manager).pool.mem = (mem != NULL) ? mem : _mem_pool_map(manager, size, &(*manager).map_size);
+	(*manager).max_size = SIZE_MAX;
+	(*manager).pool.committed_size = (flags & POOL_RESERVE) ? 0 : size;
+	(*manager).decay_ms = -1;
+	(*manager).file_fd = -1;
+	(*manager).policy = (flags & MEM_POOL_SHARDED) ? &MEM_SHARDED :
+	                    (policy == SLAB && (flags & POOL_THREAD_SAFE)) ?
+	                    &MEM_SLAB_LOCK_FREE : &MEM_POLICIES[policy];
+	(*manager).id = pool_store_next_id++;
+	(*manager).owner = pthread_self();
+	atomic_init(&(*manager).remote_frees, NULL);
 
-	if ((*manager).pool.mem == NULL){
-		free((*manager).pool.mem);//delete the memory allocation
-		free(manager);//delete the allocation of the pool store.
-		//Restore these states to their pre function states.
-		pool_store[pool_store_capacity - 1] = NULL;
-		pool_store_capacity--;
+	//The policy sets up its own index over the whole pool as free space
+	if ((*manager).pool.mem == NULL ||
+		(*manager).policy->open(manager, slot_size) != ALLOC_OK ||
+		((flags & POOL_THREAD_SAFE) && pthread_mutex_init(&(*manager).lock, NULL) != 0)){
+		(*manager).flags &= ~POOL_THREAD_SAFE;//the lock was never set up
+		_mem_pool_destroy(manager);
 		return NULL;
 	}
+	return manager;
+}
 
-	//Allocate the node heap and gap index
-	(*manager).gap_ix = calloc(MEM_GAP_IX_INIT_CAPACITY, sizeof(gap_t));
-	(*manager).node_heap = calloc(MEM_NODE_HEAP_INIT_CAPACITY, sizeof(node_t));
-	if ((*manager).node_heap == NULL || (*manager).gap_ix == NULL){
-		//Free all allocated memory
-		free((*manager).node_heap);
-		free((*manager).gap_ix);
-		free((*manager).pool.mem);
-		free(manager);
-		//Restore these states to their pre function states.
-		pool_store[pool_store_capacity - 1] = NULL;
-		pool_store_capacity--;
-		return NULL;
+/*
+ * Function Name: _mem_pool_destroy
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: Frees a pool manager and everything it owns. The pool must be
+ * out of the pool store already. A file-backed pool is synced to its file
+ * first; one that failed to open has no file_fd yet and its caller unmaps
+ * the file.
+ */
+static void _mem_pool_destroy(pool_mgr_pt pool_mgr) {
+	if ((*pool_mgr).file_fd >= 0){
+		_mem_file_sync(pool_mgr);
 	}
-	//Initialize all gap and node members.
-	(*manager).total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
-	(*manager).used_nodes = 1;
-    //call add to gap ix here once written for a gap the size of the pool
-    (*manager).gap_ix_size = MEM_GAP_IX_INIT_CAPACITY;
-    (*manager).node_heap[0].alloc_record.size = size;
-    (*manager).node_heap[0].allocated = 0;
-    (*manager).node_heap[0].used = 1;
-    (*manager).node_heap[0].prev = NULL;
-    (*manager).node_heap[0].next = NULL;
-    if(_mem_add_to_gap_ix(manager, size, &(*manager).node_heap[0]) == ALLOC_FAIL){
-        printf("Failed to add first node to gap index.");
-        exit(0);
-    }
+	(*pool_mgr).policy->close(pool_mgr);
+	_mem_decay_close(pool_mgr);
+	free((*pool_mgr).file_allocs);
+	if ((*pool_mgr).flags & POOL_THREAD_SAFE){
+		pthread_mutex_destroy(&(*pool_mgr).lock);
+	}
+	if ((*pool_mgr).flags & MEM_POOL_FILE){
+		if ((*pool_mgr).file_fd >= 0){
+			munmap((*pool_mgr).pool.mem - MEM_FILE_HEADER_SIZE,
+			       MEM_FILE_HEADER_SIZE + (*pool_mgr).pool.total_size);
+			close((*pool_mgr).file_fd);
+		}
+	}
+	else if ((*pool_mgr).parent == NULL){
+		_mem_pool_unmap((*pool_mgr).pool.mem, (*pool_mgr).map_size);
+	}
+	while ((*pool_mgr).regions != NULL){
+		region_pt region = (*pool_mgr).regions;
+		(*pool_mgr).regions = region->next;
+		_mem_pool_unmap(region->mem, region->map_size);
+		free(region);
+	}
+	free(pool_mgr);
+}
 
+/*
+ * Function Name: _mem_pool_map
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size, size_t *map_size
+ * Return Type: char *
+ * Purpose: Gets size bytes of memory for a pool or one of its regions,
+ * as the pool's flags ask, and sets map_size to the length of the
+ * mapping, 0 if it was malloc'd. Plain
+ * pools are malloc'd. POOL_HUGE_PAGES pools are mapped in whole huge
+ * pages, from the explicit huge page reserve if it can serve them, and
+ * otherwise from a mapping trimmed to a huge page boundary and advised
+ * to use transparent huge pages. Returns NULL on failure.
+ */
+static char *_mem_pool_map(pool_mgr_pt pool_mgr, size_t size, size_t *map_size) {
+    *map_size = 0;
+    if((*pool_mgr).flags & POOL_RESERVE){
+        /* address space only, _mem_pool_commit makes it usable */
+        size_t page = (size_t) sysconf(_SC_PAGESIZE);
+        if(size == 0 || size > SIZE_MAX - page){
+            return NULL;
+        }
+        size_t length = (size + page - 1) / page * page;
+        char *mem = mmap(NULL, length, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if(mem == MAP_FAILED){
+            return NULL;
+        }
+        *map_size = length;
+        return mem;
+    }
+    if(!((*pool_mgr).flags & POOL_HUGE_PAGES)){
+        return malloc(size);
+    }
+    if(size > SIZE_MAX - 2 * MEM_HUGE_PAGE_SIZE){
+        return NULL;
+    }
+    size_t length = (size + MEM_HUGE_PAGE_SIZE - 1) & ~(MEM_HUGE_PAGE_SIZE - 1);
+    char *mem = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    mem = mmap(NULL, length, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if(mem == MAP_FAILED){
+        /* over-map by a huge page and cut off both ends to align it */
+        char *raw = mmap(NULL, length + MEM_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(raw == MAP_FAILED){
+            return NULL;
+        }
+        size_t head = (size_t) (-(uintptr_t) raw & (MEM_HUGE_PAGE_SIZE - 1));
+        if(head != 0){
+            munmap(raw, head);
+        }
+        munmap(raw + head + length, MEM_HUGE_PAGE_SIZE - head);
+        mem = raw + head;
+#ifdef MADV_HUGEPAGE
+        madvise(mem, length, MADV_HUGEPAGE); // only a hint, fine if it fails
+#endif
+    }
+    *map_size = length;
+    return mem;
+}
 
-    return (pool_pt) manager;
+/*
+ * Function Name: _mem_pool_unmap
+ * Passed Variables: char *mem, size_t map_size
+ * Return Type: void
+ * Purpose: Gives back the memory _mem_pool_map got.
+ */
+static void _mem_pool_unmap(char *mem, size_t map_size) {
+    if(map_size != 0){
+        munmap(mem, map_size);
+    }
+    else{
+        free(mem);
+    }
 }
 
 /*
- * Function Name: mem_pool_close
- * Passed Variables: pool_pt pool
+ * Function Name: _mem_pool_grow
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
  * Return Type: alloc_status
- * Purpose: This function deletes a pool from memory. Alongside the pool
- * all allocated memory is deleted and the pool's manager is removed
- * from the pool store array. If the pool is not aember of any of the pool
- * managers then the function returns ALLOC_NOT_FREED telling the program that
- * the pool was not deallocated.
+ * Purpose: Adds a region of at least size bytes to a POOL_GROWABLE pool.
+ * The region is as large as the pool so far, so the pool at least
+ * doubles, but no larger than max_size allows. It becomes one gap at
+ * the end of the node list; as it is not contiguous with the node
+ * before it, the two never merge.
  */
-alloc_status mem_pool_close(pool_pt pool) {
-
-    const pool_mgr_pt manager = (pool_mgr_pt) pool;
-	//If the pool was not found then we cannot deallocate
-	if (manager == NULL) {
+static alloc_status _mem_pool_grow(pool_mgr_pt pool_mgr, size_t size) {
+    size_t room = (*pool_mgr).max_size - (*pool_mgr).pool.total_size;
+    size_t region_size = ((*pool_mgr).pool.total_size > size) ? (*pool_mgr).pool.total_size : size;
+    if(region_size > room){
+        region_size = room;
+    }
+    if(size == 0 || region_size < size){
         return ALLOC_FAIL;
     }
-    if(manager->used_nodes > 1){
-        return ALLOC_NOT_FREED;
+    region_pt region = (region_pt) calloc(1, sizeof(region_t));
+    if(region == NULL){
+        return ALLOC_FAIL;
     }
-	//free all allocated memory
-	free((*manager).pool.mem);
-	free((*manager).node_heap);
-	free((*manager).gap_ix);
-	free(manager);
-	pool_store_capacity--;
-
-    return ALLOC_OK;
+    region->size = region_size;
+    region->mem = _mem_pool_map(pool_mgr, region_size, &region->map_size);
+    node_pt node = (region->mem != NULL) ? _mem_acquire_node(pool_mgr) : NULL;
+    if(node == NULL){
+        _mem_pool_unmap(region->mem, region->map_size);
+        free(region);
+        return ALLOC_FAIL;
+    }
+    node_pt last = (*pool_mgr).tail;
+    node->alloc_record.mem = region->mem;
+    node->prev = last;
+    last->next = node;
+    _mem_nodes_track_tail(pool_mgr, node);
+    // threads that free without the lock may walk the regions at any time
+    region->next = atomic_load_explicit(&(*pool_mgr).regions, memory_order_relaxed);
+    atomic_store_explicit(&(*pool_mgr).regions, region, memory_order_release);
+    (*pool_mgr).pool.total_size += region_size;
+    (*pool_mgr).pool.committed_size += region_size;
+    if((*pool_mgr).decay != NULL){
+        _mem_decay_span(pool_mgr, region->mem, region_size); // untracked if it fails
+    }
+    return _mem_add_to_gap_ix(pool_mgr, region_size, node);
 }
 
-alloc_pt mem_new_alloc(pool_pt pool, size_t size) {
-
-    /* Upcast the pool to access the manager */
-    size_t remainSpace = 0;
-    const pool_mgr_pt manager = (pool_mgr_pt) pool;
-    /* If any of these cases are true then exit */
-    if((*manager).gap_ix_capacity == 0 || _mem_resize_node_heap(manager) == ALLOC_FAIL ||
-       (*manager).total_nodes <= (*manager).used_nodes){
-        exit(0);
-    }
-    node_pt newNode = NULL;
-    unsigned best_Position = 0;
-    if(manager->pool.policy == BEST_FIT) {
-        /*These values represent the location of the location of the current best gap
-         * and it's size. They are set to the first gap (0) because the gap index is sorted
-         * and that gap is going to have the largest amount of memory possible.*/
-        size_t current_Best = (*manager).gap_ix[0].size;
-        for (unsigned i = 0; i < (*manager).gap_ix_capacity; ++i) {
-            /*Loop throught the array until we find a gap that is a better fit than the current one*/
-            if ((*manager).gap_ix[i].size >= size && (*manager).gap_ix[i].size <= current_Best) {
-                best_Position = i;
-                newNode = (*manager).gap_ix[i].node;
-                current_Best = (*manager).gap_ix[i].size;
-                /*If the gaps size is the exact size of the requested size then break
-                 * since there is no possible way to get a better gap.*/
-                if ((*manager).gap_ix[i].size == size) {
-                    break;
-                }
-            }
-            if (i == (*manager).gap_ix_capacity - 1) {
-                //If we did not find an optimal gap
-                if (newNode == NULL) {
-                    printf("No gap that has enough memory for allocation");
-                    return NULL;
-                }
-                //Calculate the remaining gap space
-                remainSpace = newNode->alloc_record.size - size;
-            }
-        }
+/*
+ * Function Name: _mem_pool_find
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: void *
+ * Purpose: Asks the policy for a block of size bytes. A POOL_GROWABLE
+ * pool that has none grows and asks again.
+ */
+static void *_mem_pool_find(pool_mgr_pt pool_mgr, size_t size) {
+    void *block = NULL;
+    /* A completely allocated pool has nothing to offer */
+    if(pool_mgr->policy->lock_free || (*pool_mgr).pool.num_gaps != 0){
+        block = pool_mgr->policy->find(pool_mgr, size);
+    }
+    if(block == NULL && ((*pool_mgr).flags & POOL_GROWABLE) && _mem_pool_grow(pool_mgr, size) == ALLOC_OK){
+        block = pool_mgr->policy->find(pool_mgr, size);
     }
+    return block;
+}
 
+/*
+ * Function Name: _mem_pool_commit
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: alloc_status
+ * Purpose: Makes sure the pool is committed up to the end of alloc. A
+ * POOL_RESERVE pool is committed from its start up to its high-water
+ * mark, which grows by whole commit granules and never shrinks. Other
+ * pools are committed whole.
+ */
+static alloc_status _mem_pool_commit(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    if(!((*pool_mgr).flags & POOL_RESERVE)){
+        return ALLOC_OK;
+    }
+    size_t end = (size_t) (alloc->mem - (*pool_mgr).pool.mem) + alloc->size;
+    size_t committed = (*pool_mgr).pool.committed_size;
+    if(end <= committed){
+        return ALLOC_OK;
+    }
+    size_t granule = (size_t) sysconf(_SC_PAGESIZE);
+    if(granule < MEM_COMMIT_GRANULE){
+        granule = MEM_COMMIT_GRANULE;
+    }
+    size_t target = (end + granule - 1) / granule * granule;
+    if(target > (*pool_mgr).map_size){
+        target = (*pool_mgr).map_size;
+    }
+    if(mprotect((*pool_mgr).pool.mem + committed, target - committed, PROT_READ | PROT_WRITE) != 0){
+        return ALLOC_FAIL;
+    }
+    (*pool_mgr).pool.committed_size = target;
+    return ALLOC_OK;
+}
 
-    /* First Fit allocation */
-    if(manager->pool.policy == FIRST_FIT){
-        for (unsigned int i = 0; i<(*manager).total_nodes; ++i){
-            /* Find the first empty node in the array. Needs to be able to fit the size we're allocating */
-            if((*manager).node_heap[i].allocated == 0 && manager->node_heap[i].used == 1 && (*manager).node_heap[i].alloc_record.size >= size){
-                newNode = &(*manager).node_heap[i];//Set the new node to the found gap.
-                remainSpace = newNode->alloc_record.size - size;//Place the remaining amount of memory into a holder for later
-                (*manager).node_heap[i] = *newNode;
-                best_Position = i;
-                break;
-            }
-        }
+/*
+ * Function Name: _mem_pool_commit_or_undo
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: alloc_pt
+ * Purpose: Commits the memory of a new allocation, or frees it again if
+ * that fails. Returns the allocation or NULL.
+ */
+static alloc_pt _mem_pool_commit_or_undo(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    if(alloc == NULL || _mem_pool_commit(pool_mgr, alloc) == ALLOC_OK){
+        return alloc;
     }
-    /* if the node couldn't be allocated return null */
-    if(newNode == NULL){
-        return NULL;
+    void *block = pool_mgr->policy->release(pool_mgr, alloc);
+    pool_mgr->policy->coalesce(pool_mgr, block);
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_file_table_at
+ * Passed Variables: size_t size
+ * Return Type: off_t
+ * Purpose: Where segment tables may start in the file of a pool of size
+ * bytes, right after the pool memory and 8 byte aligned. Returns 0 if
+ * the file would be too large.
+ */
+static off_t _mem_file_table_at(size_t size) {
+    if(size > SIZE_MAX - MEM_FILE_HEADER_SIZE - 8 ||
+       (uint64_t) size > (uint64_t) INT64_MAX / 2){
+        return 0;
     }
-    /* remove the node from the gap index */
-    if(_mem_remove_from_gap_ix(manager,size,newNode) != ALLOC_OK){
-        return NULL;
+    return (off_t) ((MEM_FILE_HEADER_SIZE + size + 7) & ~(size_t) 7);
+}
+
+/*
+ * Function Name: _mem_file_load
+ * Passed Variables: pool_mgr_pt pool_mgr, int fd, const file_header_t *header
+ * Return Type: alloc_status
+ * Purpose: Reads the segment table the header of a reopened file points
+ * at, rebuilds the pool's node list from it and lists the allocations it
+ * held by address. A file that was never synced has no table and leaves
+ * the pool as one gap. Fails if the table does not tile the pool memory.
+ */
+static alloc_status _mem_file_load(pool_mgr_pt pool_mgr, int fd, const file_header_t *header) {
+    if(header->num_segments == 0){
+        return ALLOC_OK;
     }
-    manager->pool.num_allocs++;//Change the amount of allocations to the pool
-    manager->pool.alloc_size += size;
-    /* Alter the nodes values */
-    newNode->used = 1;
-    newNode->allocated = 1;
-    newNode->alloc_record.size = size;
-    newNode->alloc_record.mem = malloc(size);
-    node_pt gap_Node = NULL; // Create a new node to hold the node that's going to become the gap.
-    /* Check if we need a new node for the next gap or if we don't need a new gap. */
-    if(_mem_resize_node_heap(manager)== ALLOC_FAIL && remainSpace != 0){
-        exit(0);
+    if(header->num_segments > UINT32_MAX || header->num_segments > header->size ||
+       header->table_at < (uint64_t) _mem_file_table_at(pool_mgr->pool.total_size) ||
+       header->table_at > INT64_MAX || header->table_at % 8 != 0){
+        return ALLOC_FAIL;
     }
-    if(remainSpace != 0) {
-        for (unsigned i = best_Position; i < (*manager).total_nodes; ++i) {
-            /*Find an unused node */
-            if ((*manager).node_heap[i].used == 0) {
-                gap_Node = &(*manager).node_heap[i];
-                /* add this node to the gap index with the leftover size from the alloc. */
-                if (_mem_add_to_gap_ix(manager, remainSpace, gap_Node) == ALLOC_FAIL) {
-                    exit(0);
-                }
-                break;
+    unsigned num = (unsigned) header->num_segments;
+    file_segment_pt table = calloc(num, sizeof(file_segment_t));
+    pool_segment_pt segs = calloc(num, sizeof(pool_segment_t));
+    size_t bytes = num * sizeof(file_segment_t);
+    alloc_status status = ALLOC_FAIL;
+    if(table != NULL && segs != NULL &&
+       pread(fd, table, bytes, (off_t) header->table_at) == (ssize_t) bytes){
+        // offsets are checked here, sizes by the rebuild
+        uint64_t offset = 0;
+        status = ALLOC_OK;
+        for(unsigned i = 0; i < num && status == ALLOC_OK; ++i){
+            if(table[i].offset != offset || table[i].size > header->size - offset){
+                status = ALLOC_FAIL;
             }
+            segs[i].size = (size_t) table[i].size;
+            segs[i].allocated = (unsigned long) table[i].allocated;
+            offset += table[i].size;
         }
-        /* Increase the used nodes and have the nodes start to point to one another */
-        manager->used_nodes++;
-        if (newNode->next != NULL) {
-            node_pt next = newNode->next;
-            gap_Node->next = next;
-            next->prev = gap_Node;
+        if(status == ALLOC_OK){
+            status = _mem_nodes_rebuild(pool_mgr, segs, num);
         }
-        else {
-            gap_Node->next = NULL;
+        // the allocations, in address order, for mem_alloc_at
+        if(status == ALLOC_OK && pool_mgr->pool.num_allocs != 0){
+            pool_mgr->file_allocs = calloc(pool_mgr->pool.num_allocs, sizeof(file_alloc_t));
+            status = (pool_mgr->file_allocs != NULL) ? ALLOC_OK : ALLOC_FAIL;
+        }
+        for(node_pt node = pool_mgr->head; node != NULL && status == ALLOC_OK; node = node->next){
+            if(node->allocated){
+                file_alloc_pt file_alloc = &pool_mgr->file_allocs[pool_mgr->num_file_allocs++];
+                file_alloc->mem = node->alloc_record.mem;
+                file_alloc->node = node;
+            }
         }
+    }
+    free(table);
+    free(segs);
+    return status;
+}
 
-        newNode->next = gap_Node;
-        gap_Node->prev = newNode;
+/*
+ * Function Name: _mem_file_sync
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: alloc_status
+ * Purpose: Writes the segments of a file-backed pool to a new table
+ * after its memory and flushes the memory and the table. Only then does
+ * the header switch over to the new table, with a single write of its
+ * offset and length that is flushed in turn. The table the header points
+ * at is never written to, so a sync cut short by a crash leaves the file
+ * as of the sync before. The new table goes right after the pool memory
+ * if it fits in front of the current one and after the current one
+ * otherwise; the file is cut back behind it once the switch is on disk.
+ * The caller holds the pool's lock, if it has one.
+ */
+static alloc_status _mem_file_sync(pool_mgr_pt pool_mgr) {
+    unsigned num = pool_mgr->policy->inspect(pool_mgr, NULL);
+    pool_segment_pt segs = calloc(num, sizeof(pool_segment_t));
+    file_segment_pt table = calloc(num, sizeof(file_segment_t));
+    alloc_status status = ALLOC_FAIL;
+    if(segs != NULL && table != NULL){
+        pool_mgr->policy->inspect(pool_mgr, segs);
+        uint64_t offset = 0;
+        for(unsigned i = 0; i < num; ++i){
+            table[i].offset = offset;
+            table[i].size = segs[i].size;
+            table[i].allocated = segs[i].allocated;
+            offset += segs[i].size;
+        }
+        char *map = pool_mgr->pool.mem - MEM_FILE_HEADER_SIZE;
+        file_header_pt header = (file_header_pt) map;
+        off_t at = _mem_file_table_at(pool_mgr->pool.total_size);
+        size_t bytes = num * sizeof(file_segment_t);
+        if(header->num_segments != 0 && (uint64_t) bytes > header->table_at - (uint64_t) at){
+            at = (off_t) (header->table_at + header->num_segments * sizeof(file_segment_t));
+        }
+        // the table and the memory go out before the header points at them
+        if(pwrite(pool_mgr->file_fd, table, bytes, at) == (ssize_t) bytes &&
+           msync(map, MEM_FILE_HEADER_SIZE + pool_mgr->pool.total_size, MS_SYNC) == 0 &&
+           fsync(pool_mgr->file_fd) == 0){
+            header->table_at = (uint64_t) at;
+            header->num_segments = num;
+            if(msync(map, MEM_FILE_HEADER_SIZE, MS_SYNC) == 0 && fsync(pool_mgr->file_fd) == 0){
+                // whatever lies after the new table is stale
+                status = ALLOC_OK;
+                (void) ftruncate(pool_mgr->file_fd, at + (off_t) bytes);
+            }
+        }
     }
-    newNode->allocated = 1;
+    free(segs);
+    free(table);
+    return status;
+}
 
-    return (alloc_pt) newNode;
+/*
+ * Function Name: mem_pool_set_max_size
+ * Passed Variables: pool_pt pool, size_t max_size
+ * Return Type: alloc_status
+ * Purpose: Caps the size a POOL_GROWABLE pool may grow to; there is no
+ * cap until this is called. Fails for other pools and for caps below
+ * the current size of the pool.
+ */
+alloc_status mem_pool_set_max_size(pool_pt pool, size_t max_size) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    alloc_status status = ALLOC_FAIL;
+    _mem_pool_lock(pool_mgr);
+    if((pool_mgr->flags & POOL_GROWABLE) && max_size >= pool_mgr->pool.total_size){
+        pool_mgr->max_size = max_size;
+        status = ALLOC_OK;
+    }
+    _mem_pool_unlock(pool_mgr);
+    return status;
 }
 
-alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc) {
-    // get mgr from pool by casting the pointer to (pool_mgr_pt)
-    pool_mgr_pt mgr = (pool_mgr_pt) pool;
-
-    // get node from alloc by casting the pointer to (node_pt)
-    node_pt node = (node_pt) alloc;
-
-    node_pt del_node = NULL;
-    // find the node in the node heap
-    for(int i = 0; i< mgr->total_nodes; ++i){
-        if(node == &mgr->node_heap[i]){
-            del_node = &mgr->node_heap[i];
-            break;
+/*
+ * Function Name: mem_pool_set_decay
+ * Passed Variables: pool_pt pool, long decay_ms
+ * Return Type: alloc_status
+ * Purpose: Makes the pool give its memory back to the system in
+ * granules of 64 KiB (huge pages for POOL_HUGE_PAGES pools) that have
+ * held no allocation for decay_ms milliseconds, 0 as soon as they are
+ * free. Idle time is kept per granule, so a gap whose edges keep
+ * changing still gives back its untouched interior. Granules are checked
+ * on every allocation and free and when mem_pool_purge is called; a pool
+ * that sits unused needs the latter. Purged granules read as zeros the
+ * next time they are used; pool.purged_size counts them until then. A
+ * negative decay_ms turns this off again, which is the default, and
+ * forgets what was purged. SLAB and sharded pools cannot be purged.
+ */
+alloc_status mem_pool_set_decay(pool_pt pool, long decay_ms) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    if(pool_mgr->policy->add_gap == NULL){
+        return ALLOC_FAIL;
+    }
+    alloc_status status = ALLOC_OK;
+    _mem_pool_lock(pool_mgr);
+    if(decay_ms < 0){
+        _mem_decay_close(pool_mgr);
+    }
+    else if(pool_mgr->decay == NULL){
+        status = _mem_decay_open(pool_mgr);
+    }
+    if(status == ALLOC_OK){
+        pool_mgr->decay_ms = decay_ms;
+        if(decay_ms >= 0){
+            _mem_decay_purge(pool_mgr);
         }
     }
-    // this is node-to-delete
-    // make sure it's found
-    if(del_node == NULL){
+    _mem_pool_unlock(pool_mgr);
+    return status;
+}
+
+/*
+ * Function Name: mem_pool_purge
+ * Passed Variables: pool_pt pool
+ * Return Type: alloc_status
+ * Purpose: Gives back the granules whose decay has run out, for pools
+ * that go without allocations and frees for a while. Fails if the pool
+ * has no decay set. Only the owner may call it on a POOL_OWNED pool.
+ */
+alloc_status mem_pool_purge(pool_pt pool) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    alloc_status status = ALLOC_FAIL;
+    _mem_pool_lock(pool_mgr);
+    if(pool_mgr->decay_ms >= 0){
+        _mem_decay_purge(pool_mgr);
+        status = ALLOC_OK;
+    }
+    _mem_pool_unlock(pool_mgr);
+    return status;
+}
+
+/*
+ * Function Name: mem_pool_sync
+ * Passed Variables: pool_pt pool
+ * Return Type: alloc_status
+ * Purpose: Takes a snapshot of the allocations and gaps of a pool from
+ * mem_pool_open_file, writes it to its file together with the pool
+ * memory and waits until both are on disk. Opening the file again brings
+ * back this snapshot, or that of mem_pool_close if it came later; if the
+ * sync fails, the one before stays. Fails for other pools and when the
+ * file cannot be written.
+ */
+alloc_status mem_pool_sync(pool_pt pool) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    if(pool_mgr == NULL || pool_mgr->file_fd < 0){
         return ALLOC_FAIL;
     }
+    _mem_pool_lock(pool_mgr);
+    alloc_status status = _mem_file_sync(pool_mgr);
+    _mem_pool_unlock(pool_mgr);
+    return status;
+}
 
-    // convert to gap node
-    del_node->allocated = 0;
+/*
+ * Function Name: mem_pool_close
+ * Passed Variables: pool_pt pool
+ * Return Type: alloc_status
+ * Purpose: This function deletes a pool from memory. Alongside the pool
+ * all allocated memory is deleted and the pool's manager is removed
+ * from the pool store array. If the pool still has allocations then the
+ * function returns ALLOC_NOT_FREED telling the program that the pool was
+ * not deallocated. No other thread may use the pool while it is closed.
+ * A file-backed pool is closed even with allocations left, which go into
+ * the snapshot in its file; their records are gone with the pool.
+ */
+alloc_status mem_pool_close(pool_pt pool) {
 
-    // update metadata (num_allocs, alloc_size)
-    mgr->pool.num_allocs--;
-    mgr->pool.alloc_size -= del_node->alloc_record.size;
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+	//If the pool was not found then we cannot deallocate
+	if (manager == NULL) {
+        return ALLOC_FAIL;
+    }
+	pthread_mutex_lock(&pool_store_lock);
+	//blocks parked in thread caches or freed remotely are handed back first
+	_mem_tcache_detach_all(manager);
+	_mem_remote_drain(manager);
+    if(manager->pool.num_allocs > 0 && !(manager->flags & MEM_POOL_FILE)){
+		pthread_mutex_unlock(&pool_store_lock);
+        return ALLOC_NOT_FREED;
+    }
+	//take the pool out of the store, mem_free must not close it again
+	_mem_remove_from_pool_store(manager);
+	pthread_mutex_unlock(&pool_store_lock);
+	//free all allocated memory
+	_mem_pool_destroy(manager);
 
+    return ALLOC_OK;
+}
 
-    // if the next node in the list is also a gap, merge into node-to-delete
-    if(del_node->next != NULL && del_node->next->allocated == 0) {
-        node_pt next = del_node->next;
-        //   remove the next node from gap index
-        if(_mem_remove_from_gap_ix(mgr, 0, next) == ALLOC_FAIL)
-            return ALLOC_FAIL;
+alloc_pt mem_new_alloc(pool_pt pool, size_t size) {
 
-        //   add the size to the node-to-delete
-        del_node->alloc_record.size += next->alloc_record.size;
-        //   update node as unused
-        next->used = 0;
-        //   update metadata (used nodes)
-        mgr->used_nodes--;
-        //   update linked list:
-        if (next->next) {
-            next->next->prev = del_node;
-            del_node->next = next->next;
-        } else {
-            del_node->next = NULL;
+    /* Upcast the pool to access the manager */
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    alloc_pt alloc = NULL;
+    /* Small requests to a thread-cached pool are rounded up to their size
+     * class and served from this thread's cache without taking the lock */
+    if(((*manager).flags & POOL_THREAD_CACHE) && _mem_tcache_class(size) < MEM_TCACHE_CLASSES){
+        size = (_mem_tcache_class(size) + 1) * MEM_TCACHE_GRANULE;
+        tcache_pt tcache = _mem_tcache_get(manager);
+        if(tcache != NULL && (alloc = _mem_tcache_pop(tcache, size)) != NULL){
+            _mem_nodes_handout(manager, alloc);
+            return alloc;
         }
-        next->next = NULL;
-        next->prev = NULL;
     }
-    // this merged node-to-delete might need to be added to the gap index
-    // but one more thing to check...
-    // if the previous node in the list is also a gap, merge into previous!
-    if(del_node->prev!= NULL && del_node->prev->allocated == 0) {
-        //   remove the previous node from gap index
-        node_pt previous = del_node->prev;
-        if(_mem_remove_from_gap_ix(mgr, 0, previous) == ALLOC_FAIL)
-            return ALLOC_FAIL;
+    /* Only the owner allocates from an owned pool, and it first takes back
+     * what other threads freed */
+    if((*manager).flags & POOL_OWNED){
+        if(!pthread_equal(pthread_self(), (*manager).owner)){
+            return NULL;
+        }
+        _mem_remote_drain(manager);
+    }
+    _mem_pool_lock(manager);
+    /* The policy looks up a free block in its own index... */
+    void *block = _mem_pool_find(manager, size);
+    /* ...and carves the allocation out of it */
+    if(block != NULL){
+        alloc = _mem_pool_commit_or_undo(manager, manager->policy->split(manager, block, size));
+        _mem_nodes_handout(manager, alloc);
+    }
+    _mem_pool_unlock(manager);
+    /* NULL if the node couldn't be allocated */
+    return alloc;
+}
 
-        //   add the size of node-to-delete to the previous
-        previous->alloc_record.size += del_node->alloc_record.size;
-        //   update node-to-delete as unused
-        del_node->used = 0;
-        //   update metadata (used_nodes)
-        mgr->used_nodes--;
-        //   update linked list
-        if (del_node->next) {
-            previous->next = del_node->next;
-            del_node->next->prev = previous;
-        } else {
-            previous->next = NULL;
+/*
+ * Function Name: mem_new_alloc_aligned
+ * Passed Variables: pool_pt pool, size_t size, size_t alignment
+ * Return Type: alloc_pt
+ * Purpose: Like mem_new_alloc, for an allocation whose address is a
+ * multiple of alignment, which must be a power of two. The policy splits
+ * the padding in front of it off into a gap of its own, so it can still
+ * be allocated. BUDDY and SLAB pools only align to what their base
+ * address and block sizes already guarantee.
+ */
+alloc_pt mem_new_alloc_aligned(pool_pt pool, size_t size, size_t alignment) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    alloc_pt alloc = NULL;
+    if(alignment == 0 || (alignment & (alignment - 1)) != 0){
+        return NULL;
+    }
+    if((*manager).flags & POOL_OWNED){
+        if(!pthread_equal(pthread_self(), (*manager).owner)){
+            return NULL;
         }
-        del_node->next = NULL;
-        del_node->prev = NULL;
+        _mem_remote_drain(manager);
+    }
+    _mem_pool_lock(manager);
+    void *block = NULL;
+    if(manager->policy->lock_free || (*manager).pool.num_gaps != 0){
+        block = manager->policy->find_aligned(manager, size, alignment);
+    }
+    /* a new region fits the request wherever its alignment falls */
+    if(block == NULL && ((*manager).flags & POOL_GROWABLE) && size <= SIZE_MAX - alignment &&
+       _mem_pool_grow(manager, size + alignment - 1) == ALLOC_OK){
+        block = manager->policy->find_aligned(manager, size, alignment);
+    }
+    if(block != NULL){
+        alloc = _mem_pool_commit_or_undo(manager, manager->policy->split(manager, block, size));
+        _mem_nodes_handout(manager, alloc);
+    }
+    _mem_pool_unlock(manager);
+    return alloc;
+}
 
-        //   change the node to add to the previous node!
-        del_node = previous;
+/*
+ * Function Name: mem_new_alloc_batch
+ * Passed Variables: pool_pt pool, const size_t *sizes, alloc_pt *allocs, unsigned num
+ * Return Type: alloc_status
+ * Purpose: Allocates num blocks of the passed sizes at once, taking the
+ * pool lock a single time. Policies that can carve a run of allocations
+ * look up one gap for all of them and lay them out back to back, so the
+ * free index is searched and updated once. Otherwise every block is
+ * looked up in turn. Either all of allocs are filled in and ALLOC_OK is
+ * returned, or none are (they are set to NULL) and ALLOC_FAIL is.
+ * Thread-cached pools serve batches from the pool, without rounding.
+ */
+alloc_status mem_new_alloc_batch(pool_pt pool, const size_t *sizes, alloc_pt *allocs, unsigned num) {
+    const pool_mgr_pt manager = (pool_mgr_pt) pool;
+    alloc_status status = ALLOC_OK;
+    if(num == 0){
+        return ALLOC_OK;
     }
-    // add the resulting node to the gap index
-    // check success
-    if(_mem_add_to_gap_ix(mgr, del_node->alloc_record.size,del_node ) != ALLOC_OK)
+    if(sizes == NULL || allocs == NULL){
         return ALLOC_FAIL;
+    }
+    /* The owner drains its remote frees once for the whole batch */
+    if((*manager).flags & POOL_OWNED){
+        if(!pthread_equal(pthread_self(), (*manager).owner)){
+            return ALLOC_FAIL;
+        }
+        _mem_remote_drain(manager);
+    }
+    /* The total decides whether one gap can take the whole run */
+    size_t total = 0;
+    for(unsigned i = 0; i < num && total != SIZE_MAX; ++i){
+        total = (sizes[i] > SIZE_MAX - total) ? SIZE_MAX : total + sizes[i];
+    }
+    _mem_pool_lock(manager);
+    void *block = NULL;
+    if(manager->policy->split_run != NULL && total != SIZE_MAX && (*manager).pool.num_gaps != 0){
+        block = manager->policy->find(manager, total);
+    }
+    if(block != NULL && manager->policy->split_run(manager, block, sizes, allocs, num) == ALLOC_OK){
+        /* The run is committed once its last allocation is */
+        if(_mem_pool_commit(manager, allocs[num - 1]) != ALLOC_OK){
+            for(unsigned i = 0; i < num; ++i){
+                block = manager->policy->release(manager, allocs[i]);
+                manager->policy->coalesce(manager, block);
+                allocs[i] = NULL;
+            }
+            status = ALLOC_FAIL;
+        }
+    }
+    else{
+        /* One allocation at a time, undone if any of them fails */
+        for(unsigned i = 0; i < num; ++i){
+            allocs[i] = NULL;
+            block = _mem_pool_find(manager, sizes[i]);
+            if(block != NULL){
+                allocs[i] = _mem_pool_commit_or_undo(manager,
+                                                     manager->policy->split(manager, block, sizes[i]));
+            }
+            if(allocs[i] == NULL){
+                while(i-- > 0){
+                    block = manager->policy->release(manager, allocs[i]);
+                    manager->policy->coalesce(manager, block);
+                    allocs[i] = NULL;
+                }
+                status = ALLOC_FAIL;
+                break;
+            }
+        }
+    }
+    for(unsigned i = 0; i < num && status == ALLOC_OK; ++i){
+        _mem_nodes_handout(manager, allocs[i]);
+    }
+    _mem_pool_unlock(manager);
+    return status;
+}
 
-    return ALLOC_OK;
+/*
+ * Function Name: mem_realloc_alloc
+ * Passed Variables: pool_pt pool, alloc_pt alloc, size_t size
+ * Return Type: alloc_pt
+ * Purpose: Changes the size of a live allocation. The policy first tries
+ * to do it in place: a shrunk allocation hands its tail to the gap after
+ * it, and a grown one takes the front of the gap after it. If that is
+ * not possible the contents move to a new allocation and the old one is
+ * freed. Returns the allocation, which may be alloc itself, or NULL if
+ * alloc is not live in the pool or there is no room, in which case alloc
+ * is left as it was.
+ */
+alloc_pt mem_realloc_alloc(pool_pt pool, alloc_pt alloc, size_t size) {
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    // only the owner changes an owned pool
+    if((mgr->flags & POOL_OWNED) && !pthread_equal(pthread_self(), mgr->owner)){
+        return NULL;
+    }
+    _mem_pool_lock(mgr);
+    size_t old_size = (alloc == NULL) ? 0 : alloc->size;
+    alloc_status status = (alloc == NULL) ? ALLOC_FAIL : mgr->policy->resize(mgr, alloc, size);
+    // an allocation grown in place may reach past the committed memory
+    if(status == ALLOC_OK && _mem_pool_commit(mgr, alloc) != ALLOC_OK){
+        mgr->policy->resize(mgr, alloc, old_size);
+        status = ALLOC_NOT_FREED;
+    }
+    _mem_pool_unlock(mgr);
+    if(status == ALLOC_OK){
+        return alloc;
+    }
+    if(status == ALLOC_FAIL){
+        return NULL;
+    }
+    // no room in place, move it
+    alloc_pt moved = mem_new_alloc(pool, size);
+    if(moved == NULL){
+        return NULL;
+    }
+    memcpy(moved->mem, alloc->mem, (size < alloc->size) ? size : alloc->size);
+    mem_del_alloc(pool, alloc);
+    return moved;
+}
+
+alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc) {
+    // get mgr from pool by casting the pointer to (pool_mgr_pt)
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    alloc_status status = ALLOC_FAIL;
+    // blocks of thread-cached and owned pools are claimed before anything
+    // else, so that a block parked in a cache or queued by another thread
+    // cannot be freed twice
+    if(mgr->flags & (POOL_THREAD_CACHE | POOL_OWNED)){
+        node_pt node = _mem_nodes_claim(mgr, alloc);
+        if(node == NULL){
+            return ALLOC_FAIL;
+        }
+        // other threads queue blocks of an owned pool for its owner
+        if((mgr->flags & POOL_OWNED) && !pthread_equal(pthread_self(), mgr->owner)){
+            return _mem_remote_push(mgr, node);
+        }
+        // small blocks of a thread-cached pool are parked in this thread's cache
+        if((mgr->flags & POOL_THREAD_CACHE) && alloc->size % MEM_TCACHE_GRANULE == 0 &&
+           _mem_tcache_class(alloc->size) < MEM_TCACHE_CLASSES){
+            tcache_pt tcache = _mem_tcache_get(mgr);
+            if(tcache != NULL){
+                return _mem_tcache_push(tcache, alloc);
+            }
+        }
+    }
+    _mem_pool_lock(mgr);
+    // the policy makes sure it's one of its live allocations and frees it
+    void *block = mgr->policy->release(mgr, alloc);
+    if(block != NULL){
+        // then merges the block with its free neighbours and indexes it again
+        status = mgr->policy->coalesce(mgr, block);
+    }
+    _mem_pool_unlock(mgr);
+    return status;
+}
+
+/*
+ * Function Name: mem_del_alloc_batch
+ * Passed Variables: pool_pt pool, alloc_pt *allocs, unsigned num
+ * Return Type: alloc_status
+ * Purpose: Frees num allocations at once, taking the pool lock a single
+ * time. Policies that can merge a run of blocks get them sorted by
+ * address and merge neighbouring blocks with each other and with the
+ * gaps around them in one pass, indexing every resulting gap once. The
+ * live allocations among allocs are always freed; ALLOC_FAIL is returned
+ * if any of them was not a live allocation of the pool.
+ */
+alloc_status mem_del_alloc_batch(pool_pt pool, alloc_pt *allocs, unsigned num) {
+    pool_mgr_pt mgr = (pool_mgr_pt) pool;
+
+    alloc_status status = ALLOC_OK;
+    if(num == 0){
+        return ALLOC_OK;
+    }
+    if(allocs == NULL){
+        return ALLOC_FAIL;
+    }
+    void **blocks = NULL;
+    // thread caches and remote frees take blocks one at a time anyway
+    if(!(mgr->flags & POOL_THREAD_CACHE) &&
+       !((mgr->flags & POOL_OWNED) && !pthread_equal(pthread_self(), mgr->owner))){
+        blocks = (void **) malloc(num * sizeof(void *));
+    }
+    if(blocks == NULL){
+        for(unsigned i = 0; i < num; ++i){
+            if(mem_del_alloc(pool, allocs[i]) != ALLOC_OK){
+                status = ALLOC_FAIL;
+            }
+        }
+        return status;
+    }
+    _mem_pool_lock(mgr);
+    // the policy checks and frees every allocation first...
+    unsigned num_blocks = 0;
+    for(unsigned i = 0; i < num; ++i){
+        void *block = NULL;
+        if(!(mgr->flags & POOL_OWNED) || _mem_nodes_claim(mgr, allocs[i]) != NULL){
+            block = mgr->policy->release(mgr, allocs[i]);
+        }
+        if(block == NULL){
+            status = ALLOC_FAIL;
+        }
+        else{
+            blocks[num_blocks++] = block;
+        }
+    }
+    // ...then merges them, in one sweep up the pool if it can
+    if(mgr->policy->coalesce_run != NULL){
+        qsort(blocks, num_blocks, sizeof(void *), _mem_block_cmp_address);
+        if(mgr->policy->coalesce_run(mgr, blocks, num_blocks) != ALLOC_OK){
+            status = ALLOC_FAIL;
+        }
+    }
+    else{
+        for(unsigned i = 0; i < num_blocks; ++i){
+            if(mgr->policy->coalesce(mgr, blocks[i]) != ALLOC_OK){
+                status = ALLOC_FAIL;
+            }
+        }
+    }
+    _mem_pool_unlock(mgr);
+    free(blocks);
+    return status;
 }
 
 /*
@@ -443,42 +1577,156 @@ alloc_status mem_del_alloc(pool_pt pool, alloc_pt alloc) {
  * Return Type: void
  * Purpose: This function is called within main so the contents of the pool
  * may be displayed in the console. Segments and num_segments are used in
- * main and are passed back by reference. Segments is an array of all used 
- * nodes, while num_segments is the amount of used nodes.
+ * main and are passed back by reference. Segments is an array of all
+ * allocations and gaps in address order, while num_segments is their amount.
  */
 void mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments) {
 
     pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
 
-    // allocate the segments array with size == used_nodes
-    pool_segment_pt segs = (pool_segment_pt) calloc(pool_mgr->used_nodes, sizeof(pool_segment_t));
+    // allocate the segments array, the policy knows how many there are
+    if((pool_mgr->flags & POOL_OWNED) && pthread_equal(pthread_self(), pool_mgr->owner)){
+        _mem_remote_drain(pool_mgr);
+    }
+    // a sharded pool has no lock of its own, so both passes hold those
+    // of all its shards or the count could be stale by the second one
+    _mem_pool_lock(pool_mgr);
+    if(pool_mgr->flags & MEM_POOL_SHARDED){
+        _mem_shards_lock_all(pool_mgr);
+    }
+    unsigned num = pool_mgr->policy->inspect(pool_mgr, NULL);
+    pool_segment_pt segs = (pool_segment_pt) calloc(num, sizeof(pool_segment_t));
 
     // check successful
     assert(segs);
-    node_pt current = pool_mgr->node_heap;
-
-    // loop through the node heap and the segments array
-    for(int i = 0; i < pool_mgr->used_nodes; ++i){
-        //    for each node, write the size and allocated in the segment
-        segs[i].size = current->alloc_record.size;
-        segs[i].allocated = current->allocated;
-        if(current->next != NULL) {
-            current = current->next;
-        }
+    pool_mgr->policy->inspect(pool_mgr, segs);
+    if(pool_mgr->flags & MEM_POOL_SHARDED){
+        _mem_shards_unlock_all(pool_mgr);
     }
+    _mem_pool_unlock(pool_mgr);
 
     // "return" the values:
     *segments = segs;
-    *num_segments = pool_mgr->used_nodes;
+    *num_segments = num;
     /*pass these values back */
 
     return;
     
 }
 
+/*
+ * Function Name: mem_alloc_offset
+ * Passed Variables: pool_pt pool, alloc_pt alloc
+ * Return Type: size_t
+ * Purpose: The offset of an allocation from pool.mem. Unlike the record
+ * and its address, the offset stays valid when a pool from
+ * mem_pool_open_file is closed and opened again, possibly at another
+ * address, and mem_alloc_at turns it back into an allocation.
+ */
+size_t mem_alloc_offset(pool_pt pool, alloc_pt alloc) {
+    return (size_t) (alloc->mem - pool->mem);
+}
+
+/*
+ * Function Name: mem_alloc_at
+ * Passed Variables: pool_pt pool, size_t offset
+ * Return Type: alloc_pt
+ * Purpose: Returns the live allocation that starts offset bytes into a
+ * pool from mem_pool_open_file, or NULL if there is none. This is how
+ * allocations are found again after the file is reopened, so only the
+ * allocations the file held then are looked up; those made since have
+ * their records already. It is a binary search over them, so recovering
+ * k of n allocations takes O(k log n). Other pools return NULL.
+ */
+alloc_pt mem_alloc_at(pool_pt pool, size_t offset) {
+    pool_mgr_pt pool_mgr = (pool_mgr_pt) pool;
+    if(pool_mgr == NULL || offset >= pool->total_size){
+        return NULL;
+    }
+    char *mem = pool->mem + offset;
+    alloc_pt alloc = NULL;
+    _mem_pool_lock(pool_mgr);
+    unsigned lo = 0, hi = pool_mgr->num_file_allocs;
+    while(lo < hi){
+        unsigned mid = lo + (hi - lo) / 2;
+        if(pool_mgr->file_allocs[mid].mem < mem){
+            lo = mid + 1;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    if(lo < pool_mgr->num_file_allocs && pool_mgr->file_allocs[lo].mem == mem){
+        // the node may have been freed, or even reused, since
+        node_pt node = pool_mgr->file_allocs[lo].node;
+        if(node->used && node->allocated && node->alloc_record.mem == mem){
+            alloc = (alloc_pt) node;
+        }
+    }
+    _mem_pool_unlock(pool_mgr);
+    return alloc;
+}
+
 
 /* Definitions of static functions */
 
+/*
+ * Function Name: _mem_init_pool_store
+ * Passed Variables: none
+ * Return Type: alloc_status
+ * Purpose: Allocates an empty pool store. The caller holds pool_store_lock.
+ */
+static alloc_status _mem_init_pool_store() {
+	//Allocate room for the initial amount pool store capacity
+	pool_store = (pool_mgr_pt *)calloc(MEM_POOL_STORE_INIT_CAPACITY, sizeof(pool_mgr_pt));
+	//If our allocation went correctly
+	if (pool_store != NULL){
+		//Set the size and capacity of the pool store
+		pool_store_size = MEM_POOL_STORE_INIT_CAPACITY;
+
+		return ALLOC_OK;
+	}
+    //If we get to this point then we know an allocation failed
+	return ALLOC_FAIL;
+}
+
+/*
+ * Function Name: _mem_remove_from_pool_store
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: Takes a pool manager out of the pool store. The last manager
+ * moves into its slot so the open pools stay at the front of the array.
+ * The caller holds pool_store_lock.
+ */
+static void _mem_remove_from_pool_store(pool_mgr_pt pool_mgr) {
+	for (unsigned i = 0; i < pool_store_capacity; ++i){
+		if (pool_store[i] == pool_mgr){
+			pool_store[i] = pool_store[pool_store_capacity - 1];
+			pool_store[--pool_store_capacity] = NULL;
+			return;
+		}
+	}
+}
+
+/*
+ * Function Name: _mem_pool_lock, _mem_pool_unlock
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: Take and drop the lock of a POOL_THREAD_SAFE pool; no-ops for
+ * every other pool and for lock-free policies.
+ */
+static void _mem_pool_lock(pool_mgr_pt pool_mgr) {
+    if(((*pool_mgr).flags & POOL_THREAD_SAFE) && !(*pool_mgr).policy->lock_free){
+        pthread_mutex_lock(&(*pool_mgr).lock);
+    }
+}
+
+static void _mem_pool_unlock(pool_mgr_pt pool_mgr) {
+    if(((*pool_mgr).flags & POOL_THREAD_SAFE) && !(*pool_mgr).policy->lock_free){
+        pthread_mutex_unlock(&(*pool_mgr).lock);
+    }
+}
+
 /*
  * Function Name: _mem_resize_pool_store
  * Passed Variables: none
@@ -492,7 +1740,7 @@ static alloc_status _mem_resize_pool_store() {
     /* Check to see if we have too many pools. */
     if (((float) pool_store_capacity / pool_store_size)> MEM_POOL_STORE_FILL_FACTOR){
         /* Create a new pool manager that is a reallocated 'pool_store' */
-        pool_mgr_pt* reallocated_store = (pool_mgr_pt *) realloc(pool_store, pool_store_capacity* MEM_POOL_STORE_EXPAND_FACTOR * sizeof(pool_mgr_pt));
+        pool_mgr_pt* reallocated_store = (pool_mgr_pt *) realloc(pool_store, pool_store_size * MEM_POOL_STORE_EXPAND_FACTOR * sizeof(pool_mgr_pt));
         if(reallocated_store == NULL){
             /* If the allocation failed then we return a fail state. */
             return ALLOC_FAIL;
@@ -500,6 +1748,7 @@ static alloc_status _mem_resize_pool_store() {
         else{
             /* Set the pool_store to the newly allocated pool_store 'reallocated_store*/
             pool_store = reallocated_store;
+            pool_store_size *= MEM_POOL_STORE_EXPAND_FACTOR;
         }
         return ALLOC_OK;
     }
@@ -510,105 +1759,342 @@ static alloc_status _mem_resize_pool_store() {
 }
 
 /*
- * Function Name: _mem_resize_node_heap
- * Passed Variables: pool_mgr_pt pool_mgr
- * Return Type: alloc_status
- * Purpose: This function works similarly to the function 
- * _mem_resize_pool_store. The ultimate difference comes from the fact
- * that the pool_store is not being resized but instead the node heap is being 
- * resized.
+ * Function Name: _mem_tcache_class
+ * Passed Variables: size_t size
+ * Return Type: unsigned
+ * Purpose: Returns the thread cache class of a request, or
+ * MEM_TCACHE_CLASSES if it is too large (or empty) to be cached.
  */
-
-static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
-
-    /* Check to see if we have too many nodes */
-    if((*pool_mgr).used_nodes > (*pool_mgr).total_nodes * MEM_NODE_HEAP_FILL_FACTOR){
-        /* Create a new node_pt that is a reallocated node heap. */
-        /* We use the expand factor to increase the size. This is simply multiplying by 2. */
-        node_pt reallocated_node = (node_pt) realloc((*pool_mgr).node_heap, (*pool_mgr).total_nodes * MEM_NODE_HEAP_EXPAND_FACTOR * sizeof(node_pt));
-        if(reallocated_node == NULL){
-            /* If the allocation failed then return ALLOC_FAIL. */
-            return ALLOC_FAIL;
-        }
-        else{
-            /* Set the node heap to the newly allocated 'reallocated_node' */
-            (*pool_mgr).node_heap = reallocated_node;
-            (*pool_mgr).total_nodes *= MEM_NODE_HEAP_EXPAND_FACTOR;
-            return ALLOC_OK;
-        }
-    }
-    /* If we are okay on nodes then return okay. */
-    else{
-        return ALLOC_OK;
+static unsigned _mem_tcache_class(size_t size) {
+    if(size == 0 || size > MEM_TCACHE_CLASSES * MEM_TCACHE_GRANULE){
+        return MEM_TCACHE_CLASSES;
     }
+    return (unsigned) ((size - 1) / MEM_TCACHE_GRANULE);
 }
 
 /*
- * Function Name: _mem_resize_gap_ix
+ * Function Name: _mem_tcache_release
+ * Passed Variables: tcache_pt tcache, unsigned cls, unsigned num
+ * Return Type: void
+ * Purpose: Hands the num oldest blocks of a class back to the pool, where
+ * they are validated and coalesced like any other freed allocation.
+ * The caller holds the pool lock.
+ */
+static void _mem_tcache_release(tcache_pt tcache, unsigned cls, unsigned num) {
+    pool_mgr_pt pool_mgr = tcache->pool_mgr;
+    for(unsigned i = 0; i < num; ++i){
+        void *block = pool_mgr->policy->release(pool_mgr, tcache->bins[cls][i]);
+        if(block != NULL){
+            pool_mgr->policy->coalesce(pool_mgr, block);
+        }
+    }
+    tcache->count[cls] -= num;
+    memmove(tcache->bins[cls], tcache->bins[cls] + num, tcache->count[cls] * sizeof(alloc_pt));
+}
+
+/*
+ * Function Name: _mem_tcache_flush
+ * Passed Variables: tcache_pt tcache
+ * Return Type: void
+ * Purpose: Hands every cached block back to the pool in one critical
+ * section, so that cached blocks do not keep their neighbours from
+ * coalescing for long.
+ */
+static void _mem_tcache_flush(tcache_pt tcache) {
+    _mem_pool_lock(tcache->pool_mgr);
+    for(unsigned cls = 0; cls < MEM_TCACHE_CLASSES; ++cls){
+        _mem_tcache_release(tcache, cls, tcache->count[cls]);
+    }
+    _mem_pool_unlock(tcache->pool_mgr);
+    tcache->ops = 0;
+}
+
+/*
+ * Function Name: _mem_tcache_destroy
+ * Passed Variables: void *caches
+ * Return Type: void
+ * Purpose: Runs when a thread that used thread caches exits. Flushes and
+ * frees its caches; those of closed pools were already flushed.
+ */
+static void _mem_tcache_destroy(void *caches) {
+    pthread_mutex_lock(&pool_store_lock);
+    for(tcache_pt tcache = (tcache_pt) caches, next; tcache != NULL; tcache = next){
+        next = tcache->next_in_thread;
+        if(!tcache->detached){
+            pool_mgr_pt pool_mgr = tcache->pool_mgr;
+            _mem_tcache_flush(tcache);
+            _mem_pool_lock(pool_mgr);
+            tcache_pt *link = &pool_mgr->tcaches;
+            while(*link != tcache){
+                link = &(*link)->next_in_pool;
+            }
+            *link = tcache->next_in_pool;
+            _mem_pool_unlock(pool_mgr);
+        }
+        free(tcache);
+    }
+    pthread_mutex_unlock(&pool_store_lock);
+    thread_caches = NULL;
+}
+
+static void _mem_tcache_key_create() {
+    pthread_key_create(&thread_caches_key, _mem_tcache_destroy);
+}
+
+/*
+ * Function Name: _mem_tcache_get
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: tcache_pt
+ * Purpose: Returns this thread's cache for the pool, creating it on first
+ * use. Caches are matched by pool id since a closed pool's address may
+ * come back for a new pool. Returns NULL if no cache could be created,
+ * in which case the caller takes the locked path.
+ */
+static tcache_pt _mem_tcache_get(pool_mgr_pt pool_mgr) {
+    for(tcache_pt tcache = thread_caches; tcache != NULL; tcache = tcache->next_in_thread){
+        if(tcache->pool_id == pool_mgr->id){
+            return tcache;
+        }
+    }
+    if(pthread_once(&thread_caches_once, _mem_tcache_key_create) != 0){
+        return NULL;
+    }
+    tcache_pt tcache = (tcache_pt) calloc(1, sizeof(tcache_t));
+    if(tcache == NULL){
+        return NULL;
+    }
+    tcache->pool_mgr = pool_mgr;
+    tcache->pool_id = pool_mgr->id;
+    pthread_mutex_lock(&pool_store_lock);
+    /* drop the caches of pools that were closed meanwhile */
+    for(tcache_pt *link = &thread_caches; *link != NULL; ){
+        tcache_pt stale = *link;
+        if(stale->detached){
+            *link = stale->next_in_thread;
+            free(stale);
+        }
+        else{
+            link = &stale->next_in_thread;
+        }
+    }
+    _mem_pool_lock(pool_mgr);
+    tcache->next_in_pool = pool_mgr->tcaches;
+    pool_mgr->tcaches = tcache;
+    _mem_pool_unlock(pool_mgr);
+    pthread_mutex_unlock(&pool_store_lock);
+    tcache->next_in_thread = thread_caches;
+    thread_caches = tcache;
+    pthread_setspecific(thread_caches_key, thread_caches);
+    return tcache;
+}
+
+/*
+ * Function Name: _mem_tcache_pop
+ * Passed Variables: tcache_pt tcache, size_t size
+ * Return Type: alloc_pt
+ * Purpose: Takes the most recently cached block of the class of size, a
+ * class-rounded request, or returns NULL if the class is empty.
+ */
+static alloc_pt _mem_tcache_pop(tcache_pt tcache, size_t size) {
+    unsigned cls = _mem_tcache_class(size);
+    if(tcache->count[cls] == 0){
+        return NULL;
+    }
+    alloc_pt alloc = tcache->bins[cls][--tcache->count[cls]];
+    if(++tcache->ops >= MEM_TCACHE_FLUSH_OPS){
+        _mem_tcache_flush(tcache);
+    }
+    return alloc;
+}
+
+/*
+ * Function Name: _mem_tcache_push
+ * Passed Variables: tcache_pt tcache, alloc_pt alloc
+ * Return Type: alloc_status
+ * Purpose: Parks a freed block in the cache. The caller has claimed its
+ * node, so it is a block of the pool that was not freed already. A
+ * full class first hands its older half back to the pool, and every
+ * MEM_TCACHE_FLUSH_OPS hits the whole cache is flushed.
+ */
+static alloc_status _mem_tcache_push(tcache_pt tcache, alloc_pt alloc) {
+    unsigned cls = _mem_tcache_class(alloc->size);
+    if(tcache->count[cls] == MEM_TCACHE_BIN_SIZE){
+        _mem_pool_lock(tcache->pool_mgr);
+        _mem_tcache_release(tcache, cls, MEM_TCACHE_BIN_SIZE / 2);
+        _mem_pool_unlock(tcache->pool_mgr);
+    }
+    tcache->bins[cls][tcache->count[cls]++] = alloc;
+    if(++tcache->ops >= MEM_TCACHE_FLUSH_OPS){
+        _mem_tcache_flush(tcache);
+    }
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_nodes_handout
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: void
+ * Purpose: Sets the handed-out mark of a block of a thread-cached or
+ * owned pool that goes to the user, so that exactly one free can claim
+ * it back. Does nothing for other pools or a NULL alloc.
+ */
+static void _mem_nodes_handout(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    if(alloc != NULL && (pool_mgr->flags & (POOL_THREAD_CACHE | POOL_OWNED))){
+        atomic_store_explicit(&((node_pt) alloc)->handed_out, 1, memory_order_relaxed);
+    }
+}
+
+/*
+ * Function Name: _mem_tcache_detach_all
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: Hands the blocks of all thread caches of a pool back to it and
+ * marks the caches detached, for their threads to free. The caller holds
+ * pool_store_lock; no other thread may use the pool meanwhile.
+ */
+static void _mem_tcache_detach_all(pool_mgr_pt pool_mgr) {
+    if(!(pool_mgr->flags & POOL_THREAD_CACHE)){
+        return;
+    }
+    _mem_pool_lock(pool_mgr);
+    for(tcache_pt tcache = pool_mgr->tcaches; tcache != NULL; tcache = tcache->next_in_pool){
+        for(unsigned cls = 0; cls < MEM_TCACHE_CLASSES; ++cls){
+            _mem_tcache_release(tcache, cls, tcache->count[cls]);
+        }
+        tcache->detached = 1;
+    }
+    pool_mgr->tcaches = NULL;
+    _mem_pool_unlock(pool_mgr);
+}
+
+/*
+ * Function Name: _mem_remote_push
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: alloc_status
+ * Purpose: Queues a block of an owned pool that is freed by another
+ * thread. The queue is a LIFO threaded through the nodes, so this is one
+ * compare-and-swap on its head. The caller has claimed the node, so it
+ * is a block of the pool that no other free can queue or release.
+ */
+static alloc_status _mem_remote_push(pool_mgr_pt pool_mgr, node_pt node) {
+    node_pt head = atomic_load_explicit(&(*pool_mgr).remote_frees, memory_order_relaxed);
+    do {
+        node->remote_next = head;
+    } while(!atomic_compare_exchange_weak_explicit(&(*pool_mgr).remote_frees, &head, node,
+                                                   memory_order_release, memory_order_relaxed));
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_remote_drain
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: Takes the whole remote-free queue in one exchange and frees
+ * its blocks into the pool. Called by the owner, or while the pool is
+ * being closed.
+ */
+static void _mem_remote_drain(pool_mgr_pt pool_mgr) {
+    if(!((*pool_mgr).flags & POOL_OWNED)){
+        return;
+    }
+    node_pt node = atomic_exchange_explicit(&(*pool_mgr).remote_frees, NULL, memory_order_acquire);
+    while(node != NULL){
+        node_pt next = node->remote_next;
+        node->remote_next = NULL;
+        void *block = (*pool_mgr).policy->release(pool_mgr, (alloc_pt) node);
+        if(block != NULL){
+            (*pool_mgr).policy->coalesce(pool_mgr, block);
+        }
+        node = next;
+    }
+}
+
+/*
+ * Function Name: _mem_resize_node_heap
  * Passed Variables: pool_mgr_pt pool_mgr
  * Return Type: alloc_status
- * Purpose: This function works similarly to the function
+ * Purpose: This function works similarly to the function 
  * _mem_resize_pool_store. The ultimate difference comes from the fact
- * that the pool_store is not being resized but instead the gap index
- * is being resized.
+ * that the node heap is never moved: it grows by appending a new chunk
+ * as large as all the existing ones together to a chunk directory of
+ * fixed size, which never moves either. The alloc_pt's handed out to the
+ * user point into the chunks and therefore stay valid as the pool grows.
  */
-static alloc_status _mem_resize_gap_ix(pool_mgr_pt pool_mgr) {
 
+static alloc_status _mem_resize_node_heap(pool_mgr_pt pool_mgr) {
+
+    /* Check to see if we have too many nodes */
     if((*pool_mgr).used_nodes > (*pool_mgr).total_nodes * MEM_NODE_HEAP_FILL_FACTOR){
-        /* Create a new node_pt that is a reallocated gap index. */
-        /* We use the expand factor to increase the size. This is simply multiplying by 2. */
-        gap_pt reallocated_gap = (gap_pt) realloc((*pool_mgr).gap_ix, (*pool_mgr).gap_ix_size * MEM_GAP_IX_EXPAND_FACTOR * sizeof(gap_pt));
-        if(reallocated_gap == NULL){
+        /* The new chunk doubles the node heap. This is simply multiplying by 2. */
+        if((*pool_mgr).node_heap_chunks == MEM_NODE_HEAP_MAX_CHUNKS ||
+           (*pool_mgr).total_nodes > UINT_MAX / MEM_NODE_HEAP_EXPAND_FACTOR){
+            return ALLOC_FAIL;
+        }
+        unsigned chunk_nodes = (*pool_mgr).total_nodes * (MEM_NODE_HEAP_EXPAND_FACTOR - 1);
+        node_pt chunk = (node_pt) calloc(chunk_nodes, sizeof(node_t));
+        if(chunk == NULL){
             /* If the allocation failed then return ALLOC_FAIL. */
             return ALLOC_FAIL;
         }
         else{
-            /* Set the node heap to the newly allocated 'reallocated_gap' */
-            (*pool_mgr).gap_ix = reallocated_gap;
-            (*pool_mgr).gap_ix_capacity *= MEM_GAP_IX_EXPAND_FACTOR;
+            /* Append the new chunk to the directory and its nodes to the free node list */
+            for(unsigned i = chunk_nodes; i-- > 0; ){
+                chunk[i].ix = (*pool_mgr).total_nodes + i;
+                chunk[i].next = (*pool_mgr).free_nodes;
+                (*pool_mgr).free_nodes = &chunk[i];
+            }
+            /* frees that do not take the lock may look the chunk up right away */
+            __atomic_store_n(&(*pool_mgr).node_heap[(*pool_mgr).node_heap_chunks++], chunk, __ATOMIC_RELEASE);
+            (*pool_mgr).total_nodes += chunk_nodes;
             return ALLOC_OK;
         }
     }
-    /* If we are okay on gaps then return okay. */
+    /* If we are okay on nodes then return okay. */
     else{
         return ALLOC_OK;
     }
 }
 
+/*
+ * Function Name: _mem_node_at
+ * Passed Variables: pool_mgr_pt pool_mgr, unsigned ix
+ * Return Type: node_pt
+ * Purpose: This function maps a node index onto the chunked node heap.
+ * Chunk 0 holds the first MEM_NODE_HEAP_INIT_CAPACITY nodes and every
+ * following chunk k holds MEM_NODE_HEAP_INIT_CAPACITY << (k - 1) nodes,
+ * so the chunk is found from the position of the highest set bit.
+ */
+static node_pt _mem_node_at(pool_mgr_pt pool_mgr, unsigned ix) {
+    unsigned quot = ix / MEM_NODE_HEAP_INIT_CAPACITY;
+    if(quot == 0){
+        return &(*pool_mgr).node_heap[0][ix];
+    }
+    unsigned chunk = 32 - __builtin_clz(quot);
+    return &(*pool_mgr).node_heap[chunk][ix - (MEM_NODE_HEAP_INIT_CAPACITY << (chunk - 1))];
+}
+
 /*
  * Function Name: _mem_add_to_gap_ix
  * Passed Variables: pool_mgr_pt pool_mgr, size_t size, node_pt node
  * Return Type: alloc_status
- * Purpose: The purpose of this function is to add anew gap to the gap index.
- * This gap is a passed as a node from the node index. The first step of the 
- * function is to check to make sure that we have enough size in the gap index.
- * Once that is done we place the gap at the fiirst unused position of the 
- * gap index (gap_ix_capacity). Then any neccesary data members of the gap, node
- * and pool manager are set. The gap index is then sorted so the biggest gap is at
- * the top of the index.
+ * Purpose: The purpose of this function is to add a new gap to the gap index.
+ * This gap is a passed as a node from the node heap. The node's size is set
+ * first since the policy may key its index on it, then the policy links
+ * the node into its index.
  */
 static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
                                        size_t size,
                                        node_pt node) {
-    /* Check to see if we need to resize */
-    if(pool_mgr->gap_ix_capacity != 0 || pool_mgr->gap_ix_capacity / pool_mgr->gap_ix_size > MEM_GAP_IX_FILL_FACTOR){
-        if(_mem_resize_gap_ix(pool_mgr) == ALLOC_FAIL){
-            return ALLOC_FAIL;
-        }
-    }
     /* Set the nodes values */
     (*node).allocated = 0;
     (*node).used = 1;
-    /* Add the gap to the index and node heap */
-    (*pool_mgr).gap_ix[pool_mgr->gap_ix_capacity].node = node;
-    (*pool_mgr).gap_ix[pool_mgr->gap_ix_capacity].node->alloc_record.size = size;
-    (*pool_mgr).gap_ix[pool_mgr->gap_ix_capacity].size = size;
+    (*node).alloc_record.size = size;
+    /* Add the gap to the index */
+    (*pool_mgr).policy->add_gap(pool_mgr, node);
     /*Increase the amount of gaps */
-    (*pool_mgr).gap_ix_capacity++;
     (*pool_mgr).pool.num_gaps++;
-    /* Sort the index */
-    return _mem_sort_gap_ix(pool_mgr);
 
+    return ALLOC_OK;
 }
 
 /*
@@ -616,74 +2102,2327 @@ static alloc_status _mem_add_to_gap_ix(pool_mgr_pt pool_mgr,
  * Passed Variables: pool_mgr_pt pool_mgr, size_t size, node_pt node
  * Return Type: alloc_status
  * Purpose: This function removes a gap from the index, which is done
- * when a node needs to have memory allocated. To find the gap that we
- * are attempting to remove we use a node pointer and compare it to the
- * node thta the gap is pointing to. Once this gap is found, we swap it 
- * with the gap at the bottom of the index, overwrite it's data and then
- * resort the gap; ending with the gap capacity being decremented.
+ * when a node needs to have memory allocated or is merged into a
+ * neighbour. The node must still carry the size it was indexed with.
+ * If the node is not a gap ALLOC_FAIL is returned.
  */
 static alloc_status _mem_remove_from_gap_ix(pool_mgr_pt pool_mgr,
                                             size_t size,
                                             node_pt node) {
-    int gap_Location = -1;
-    /* Loop throught the gap index until we find the gap that is that node. */
-    for(unsigned i = 0; i< pool_mgr->gap_ix_capacity; ++i){
-        /*Once the node is found set the index number to Gap location and break. */
-        if(pool_mgr->gap_ix[i].node == node){
-            gap_Location = i;
-            break;
-        }
-    }
-    /* If the node wasn't found return ALLOC_FAIL */
-    if(gap_Location == -1){
+    /* Gaps are the only used, unallocated nodes, and all of them are indexed */
+    if((*node).used == 0 || (*node).allocated != 0){
         return ALLOC_FAIL;
     }
-    /* Swap the node to be removed with the last filled gap in the index */
-    pool_mgr->gap_ix[gap_Location] = pool_mgr->gap_ix[pool_mgr->gap_ix_capacity -1];
-    /* Delete the node that is now in the last spot of the "filled index. */
-    pool_mgr->gap_ix[pool_mgr->gap_ix_capacity-1].node = NULL;
-    pool_mgr->gap_ix[pool_mgr->gap_ix_capacity-1].size = 0;
+    (*pool_mgr).policy->remove_gap(pool_mgr, node);
     /* Decrement the amount of used gaps */
-    --pool_mgr->gap_ix_capacity;
     --pool_mgr->pool.num_gaps;
 
-    return _mem_sort_gap_ix(pool_mgr);
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_now_ms
+ * Passed Variables: none
+ * Return Type: unsigned long long
+ * Purpose: Milliseconds on the monotonic clock, for gap decay.
+ */
+static unsigned long long _mem_now_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long) now.tv_sec * 1000 + (unsigned long long) now.tv_nsec / 1000000;
+}
+
+/*
+ * Function Name: _mem_decay_granule
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: size_t
+ * Purpose: The size of the granules the pool is purged in.
+ */
+static size_t _mem_decay_granule(pool_mgr_pt pool_mgr) {
+    return ((*pool_mgr).flags & POOL_HUGE_PAGES) ? MEM_HUGE_PAGE_SIZE : MEM_DECAY_GRANULE;
+}
+
+/*
+ * Function Name: _mem_decay_push, _mem_decay_unlink
+ * Passed Variables: decay_pt span, size_t ix
+ * Return Type: void
+ * Purpose: Append a granule to the idle FIFO of its span and take one
+ * off it. Granules are pushed with the current time, so the FIFO stays
+ * ordered by idle_since.
+ */
+static void _mem_decay_push(decay_pt span, size_t ix) {
+    granule_pt granule = &span->granules[ix];
+    granule->idle_next = span->num_granules;
+    granule->idle_prev = span->idle_tail;
+    if(span->idle_tail != span->num_granules){
+        span->granules[span->idle_tail].idle_next = ix;
+    }
+    else{
+        span->idle_head = ix;
+    }
+    span->idle_tail = ix;
+}
+
+static void _mem_decay_unlink(decay_pt span, size_t ix) {
+    granule_pt granule = &span->granules[ix];
+    if(granule->idle_prev != span->num_granules){
+        span->granules[granule->idle_prev].idle_next = granule->idle_next;
+    }
+    else{
+        span->idle_head = granule->idle_next;
+    }
+    if(granule->idle_next != span->num_granules){
+        span->granules[granule->idle_next].idle_prev = granule->idle_prev;
+    }
+    else{
+        span->idle_tail = granule->idle_prev;
+    }
+}
+
+/*
+ * Function Name: _mem_decay_span
+ * Passed Variables: pool_mgr_pt pool_mgr, char *mem, size_t size
+ * Return Type: alloc_status
+ * Purpose: Starts tracking a region of the pool. Its whole granules all
+ * start out idle from now on; the caller accounts for the allocations
+ * already in it. The partial granules at its ends are never purged.
+ */
+static alloc_status _mem_decay_span(pool_mgr_pt pool_mgr, char *mem, size_t size) {
+    size_t granule = _mem_decay_granule(pool_mgr);
+    uintptr_t base = ((uintptr_t) mem + granule - 1) & ~(uintptr_t) (granule - 1);
+    uintptr_t end = ((uintptr_t) mem + size) & ~(uintptr_t) (granule - 1);
+    decay_pt span = (decay_pt) calloc(1, sizeof(decay_t));
+    if(span == NULL){
+        return ALLOC_FAIL;
+    }
+    span->mem = mem;
+    span->size = size;
+    span->base = (char *) base;
+    span->num_granules = (end > base) ? (end - base) / granule : 0;
+    span->granules = (granule_pt) calloc(span->num_granules + 1, sizeof(granule_t));
+    if(span->granules == NULL){
+        free(span);
+        return ALLOC_FAIL;
+    }
+    span->idle_head = span->num_granules;
+    span->idle_tail = span->num_granules;
+    unsigned long long now = _mem_now_ms();
+    for(size_t ix = 0; ix < span->num_granules; ++ix){
+        span->granules[ix].state = MEM_GRANULE_IDLE;
+        span->granules[ix].idle_since = now;
+        _mem_decay_push(span, ix);
+    }
+    span->next = (*pool_mgr).decay;
+    (*pool_mgr).decay = span;
+    return ALLOC_OK;
 }
 
 /*
- * Function Name: _mem_sort_gap_ix
+ * Function Name: _mem_decay_open
  * Passed Variables: pool_mgr_pt pool_mgr
  * Return Type: alloc_status
- * Purpose: This function performs a bubble sort on the gap index
- * sorting the index based on each gap's size. If the amount of gaps is
- * smaller than 2 then there is no need to sort the memory and just returns
- * ALLOC_OK.
+ * Purpose: Starts tracking every region of the pool and accounts for
+ * the allocations in them, which takes one walk of the node list.
  */
-static alloc_status _mem_sort_gap_ix(pool_mgr_pt pool_mgr) {
-    /* This is just a bubble sort that sorts the gaps based on their size. */
-    if(((*pool_mgr).gap_ix_capacity <=1)){
-        return ALLOC_OK;
+static alloc_status _mem_decay_open(pool_mgr_pt pool_mgr) {
+    if(_mem_decay_span(pool_mgr, (*pool_mgr).pool.mem, (*pool_mgr).first_size) != ALLOC_OK){
+        return ALLOC_FAIL;
+    }
+    for(region_pt region = (*pool_mgr).regions; region != NULL; region = region->next){
+        if(_mem_decay_span(pool_mgr, region->mem, region->size) != ALLOC_OK){
+            _mem_decay_close(pool_mgr);
+            return ALLOC_FAIL;
+        }
+    }
+    for(node_pt node = (*pool_mgr).head; node != NULL; node = node->next){
+        if(node->allocated){
+            _mem_decay_live(pool_mgr, node->alloc_record.mem, node->alloc_record.size, 1);
+        }
+    }
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_decay_close
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: Stops tracking the pool's idle time and forgets what was
+ * purged. Also cleans up after an open that failed half way.
+ */
+static void _mem_decay_close(pool_mgr_pt pool_mgr) {
+    while((*pool_mgr).decay != NULL){
+        decay_pt span = (*pool_mgr).decay;
+        (*pool_mgr).decay = span->next;
+        free(span->granules);
+        free(span);
+    }
+    (*pool_mgr).pool.purged_size = 0;
+}
+
+/*
+ * Function Name: _mem_decay_live
+ * Passed Variables: pool_mgr_pt pool_mgr, const char *mem, size_t size, int add
+ * Return Type: void
+ * Purpose: Called wherever alloc_size changes: size bytes from mem on
+ * were allocated (add) or freed. A granule that gets its first allocated
+ * byte leaves the idle FIFO, and stops counting as purged; one that
+ * loses its last goes to the back of the FIFO. Then the granules whose
+ * decay ran out are purged. Does nothing while decay is off.
+ */
+static void _mem_decay_live(pool_mgr_pt pool_mgr, const char *mem, size_t size, int add) {
+    if((*pool_mgr).decay == NULL || size == 0){
+        return;
+    }
+    decay_pt span = (*pool_mgr).decay;
+    while(span != NULL && (uintptr_t) mem - (uintptr_t) span->mem >= span->size){
+        span = span->next;
     }
-    for(unsigned int i =0; i < (*pool_mgr).gap_ix_capacity-1; ++i){
-        for(unsigned int j = 1; j < (*pool_mgr).gap_ix_capacity-2;++j){
-            /* If the sizes are unordered. */
-            if((*pool_mgr).gap_ix[j].size < (*pool_mgr).gap_ix[j+1].size){
-                /* Swap them :D */
-                gap_t swapper = (*pool_mgr).gap_ix[j];
-                (*pool_mgr).gap_ix[j] = (*pool_mgr).gap_ix[i];
-                (*pool_mgr).gap_ix[i] = swapper;
+    if(span == NULL){
+        return;
+    }
+    size_t granule = _mem_decay_granule(pool_mgr);
+    uintptr_t base = (uintptr_t) span->base;
+    uintptr_t lo = ((uintptr_t) mem > base) ? (uintptr_t) mem : base;
+    uintptr_t hi = (uintptr_t) mem + size;
+    if(hi > base + span->num_granules * granule){
+        hi = base + span->num_granules * granule;
+    }
+    unsigned long long now = add ? 0 : _mem_now_ms();
+    for(uintptr_t at = lo; at < hi; ){
+        size_t ix = (at - base) / granule;
+        uintptr_t next = base + (ix + 1) * granule;
+        size_t bytes = ((next < hi) ? next : hi) - at;
+        granule_pt gr = &span->granules[ix];
+        if(add){
+            if(gr->state == MEM_GRANULE_IDLE){
+                _mem_decay_unlink(span, ix);
             }
-            if(pool_mgr->gap_ix[i].size == pool_mgr->gap_ix[j].size){
-                if(pool_mgr->gap_ix[i].node < pool_mgr->gap_ix[j].node){
-                    gap_t swapper = (*pool_mgr).gap_ix[j];
-                    (*pool_mgr).gap_ix[j] = (*pool_mgr).gap_ix[i];
-                    (*pool_mgr).gap_ix[i] = swapper;
-                }
+            else if(gr->state == MEM_GRANULE_PURGED){
+                (*pool_mgr).pool.purged_size -= granule;
             }
+            gr->state = MEM_GRANULE_LIVE;
+            gr->live += bytes;
+        }
+        else if((gr->live -= bytes) == 0){
+            gr->state = MEM_GRANULE_IDLE;
+            gr->idle_since = now;
+            _mem_decay_push(span, ix);
         }
+        at = next;
     }
+    if((*pool_mgr).decay_ms >= 0){
+        _mem_decay_purge(pool_mgr);
+    }
+}
 
-    return ALLOC_OK;
+/*
+ * Function Name: _mem_decay_purge
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: Purges the granules that have been idle for at least the
+ * decay time, oldest first, with MADV_DONTNEED so that the pool's
+ * resident size drops right away. Granules past the committed part of a
+ * POOL_RESERVE pool are only taken off the FIFO. Checking costs a clock
+ * read and a look at the head of each FIFO.
+ */
+static void _mem_decay_purge(pool_mgr_pt pool_mgr) {
+    size_t granule = _mem_decay_granule(pool_mgr);
+    uintptr_t committed = (uintptr_t) (*pool_mgr).pool.mem + (*pool_mgr).pool.committed_size;
+    unsigned long long now = 0;
+    for(decay_pt span = (*pool_mgr).decay; span != NULL; span = span->next){
+        while(span->idle_head != span->num_granules){
+            size_t ix = span->idle_head;
+            granule_pt gr = &span->granules[ix];
+            if(now == 0){
+                now = _mem_now_ms();
+            }
+            if(now - gr->idle_since < (unsigned long long) (*pool_mgr).decay_ms){
+                break;
+            }
+            _mem_decay_unlink(span, ix);
+            uintptr_t start = (uintptr_t) span->base + ix * granule;
+            gr->state = MEM_GRANULE_PARKED;
+            if(((*pool_mgr).flags & POOL_RESERVE) && start + granule > committed){
+                continue;
+            }
+            if(madvise((void *) start, granule, MADV_DONTNEED) == 0){
+                gr->state = MEM_GRANULE_PURGED;
+                (*pool_mgr).pool.purged_size += granule;
+            }
+        }
+    }
+}
+
+/*
+ * Function Name: _mem_gap_cmp
+ * Passed Variables: node_pt a, node_pt b
+ * Return Type: int
+ * Purpose: Orders gaps by size and then by address, which makes every
+ * key in the gap index unique.
+ */
+static int _mem_gap_cmp(node_pt a, node_pt b) {
+    if(a->alloc_record.size != b->alloc_record.size){
+        return (a->alloc_record.size < b->alloc_record.size) ? -1 : 1;
+    }
+    if(a->alloc_record.mem != b->alloc_record.mem){
+        return (a->alloc_record.mem < b->alloc_record.mem) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * Function Name: _mem_gap_cmp_address
+ * Passed Variables: node_pt a, node_pt b
+ * Return Type: int
+ * Purpose: Orders gaps by address only, which is the order FIRST_FIT
+ * searches them in.
+ */
+static int _mem_gap_cmp_address(node_pt a, node_pt b) {
+    if(a->alloc_record.mem != b->alloc_record.mem){
+        return (a->alloc_record.mem < b->alloc_record.mem) ? -1 : 1;
+    }
+    return 0;
+}
+
+static int _mem_gap_height(node_pt node) {
+    return (node == NULL) ? 0 : node->gap_height;
+}
+
+static size_t _mem_gap_max(node_pt node) {
+    return (node == NULL) ? 0 : node->gap_max;
+}
+
+static void _mem_gap_update(node_pt node) {
+    int left = _mem_gap_height(node->gap_left);
+    int right = _mem_gap_height(node->gap_right);
+    node->gap_height = ((left > right) ? left : right) + 1;
+    size_t max = node->alloc_record.size;
+    if(_mem_gap_max(node->gap_left) > max){
+        max = _mem_gap_max(node->gap_left);
+    }
+    if(_mem_gap_max(node->gap_right) > max){
+        max = _mem_gap_max(node->gap_right);
+    }
+    node->gap_max = max;
+}
+
+static node_pt _mem_gap_rotate_right(node_pt node) {
+    node_pt left = node->gap_left;
+    node->gap_left = left->gap_right;
+    left->gap_right = node;
+    _mem_gap_update(node);
+    _mem_gap_update(left);
+    return left;
+}
+
+static node_pt _mem_gap_rotate_left(node_pt node) {
+    node_pt right = node->gap_right;
+    node->gap_right = right->gap_left;
+    right->gap_left = node;
+    _mem_gap_update(node);
+    _mem_gap_update(right);
+    return right;
+}
+
+/*
+ * Function Name: _mem_gap_balance
+ * Passed Variables: node_pt node
+ * Return Type: node_pt
+ * Purpose: Restores the AVL property at a node whose subtrees differ in
+ * height by at most two and returns the new root of the subtree.
+ */
+static node_pt _mem_gap_balance(node_pt node) {
+    _mem_gap_update(node);
+    int balance = _mem_gap_height(node->gap_left) - _mem_gap_height(node->gap_right);
+    if(balance > 1){
+        if(_mem_gap_height(node->gap_left->gap_left) < _mem_gap_height(node->gap_left->gap_right)){
+            node->gap_left = _mem_gap_rotate_left(node->gap_left);
+        }
+        return _mem_gap_rotate_right(node);
+    }
+    if(balance < -1){
+        if(_mem_gap_height(node->gap_right->gap_right) < _mem_gap_height(node->gap_right->gap_left)){
+            node->gap_right = _mem_gap_rotate_right(node->gap_right);
+        }
+        return _mem_gap_rotate_left(node);
+    }
+    return node;
+}
+
+/*
+ * Function Name: _mem_gap_ix_insert
+ * Passed Variables: node_pt root, node_pt node, gap_cmp_fn cmp
+ * Return Type: node_pt
+ * Purpose: Links a gap node into the AVL tree rooted at root and
+ * returns the new root.
+ */
+static node_pt _mem_gap_ix_insert(node_pt root, node_pt node, gap_cmp_fn cmp) {
+    if(root == NULL){
+        node->gap_left = NULL;
+        node->gap_right = NULL;
+        _mem_gap_update(node);
+        return node;
+    }
+    if(cmp(node, root) < 0){
+        root->gap_left = _mem_gap_ix_insert(root->gap_left, node, cmp);
+    }
+    else{
+        root->gap_right = _mem_gap_ix_insert(root->gap_right, node, cmp);
+    }
+    return _mem_gap_balance(root);
+}
+
+static node_pt _mem_gap_ix_remove_min(node_pt root, node_pt *min) {
+    if(root->gap_left == NULL){
+        *min = root;
+        return root->gap_right;
+    }
+    root->gap_left = _mem_gap_ix_remove_min(root->gap_left, min);
+    return _mem_gap_balance(root);
 }
 
+/*
+ * Function Name: _mem_gap_ix_remove
+ * Passed Variables: node_pt root, node_pt node, gap_cmp_fn cmp
+ * Return Type: node_pt
+ * Purpose: Unlinks a gap node from the AVL tree rooted at root and
+ * returns the new root. The node is replaced by its in-order successor,
+ * so no other node changes its place in memory.
+ */
+static node_pt _mem_gap_ix_remove(node_pt root, node_pt node, gap_cmp_fn cmp) {
+    if(root == NULL){
+        return NULL;
+    }
+    int order = cmp(node, root);
+    if(order < 0){
+        root->gap_left = _mem_gap_ix_remove(root->gap_left, node, cmp);
+    }
+    else if(order > 0){
+        root->gap_right = _mem_gap_ix_remove(root->gap_right, node, cmp);
+    }
+    else{
+        if(root != node){
+            return root;
+        }
+        node_pt left = node->gap_left, right = node->gap_right;
+        node->gap_left = node->gap_right = NULL;
+        if(right == NULL){
+            return left;
+        }
+        node_pt successor = NULL;
+        right = _mem_gap_ix_remove_min(right, &successor);
+        successor->gap_left = left;
+        successor->gap_right = right;
+        return _mem_gap_balance(successor);
+    }
+    return _mem_gap_balance(root);
+}
+
+/*
+ * Function Name: _mem_ff_add_gap, _mem_ff_remove_gap
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: Keep the gap index of a FIRST_FIT pool, ordered by address.
+ */
+static void _mem_ff_add_gap(pool_mgr_pt pool_mgr, node_pt node) {
+    (*pool_mgr).gap_ix = _mem_gap_ix_insert((*pool_mgr).gap_ix, node, _mem_gap_cmp_address);
+}
 
+static void _mem_ff_remove_gap(pool_mgr_pt pool_mgr, node_pt node) {
+    (*pool_mgr).gap_ix = _mem_gap_ix_remove((*pool_mgr).gap_ix, node, _mem_gap_cmp_address);
+}
+
+/*
+ * Function Name: _mem_bf_add_gap, _mem_bf_remove_gap
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: Keep the gap index of a BEST_FIT pool, ordered by (size, address).
+ */
+static void _mem_bf_add_gap(pool_mgr_pt pool_mgr, node_pt node) {
+    (*pool_mgr).gap_ix = _mem_gap_ix_insert((*pool_mgr).gap_ix, node, _mem_gap_cmp);
+}
+
+static void _mem_bf_remove_gap(pool_mgr_pt pool_mgr, node_pt node) {
+    (*pool_mgr).gap_ix = _mem_gap_ix_remove((*pool_mgr).gap_ix, node, _mem_gap_cmp);
+}
+
+/*
+ * Function Name: _mem_no_gap_ix
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: NEXT_FIT walks the node list itself and keeps no index.
+ */
+static void _mem_no_gap_ix(pool_mgr_pt pool_mgr, node_pt node) {
+    (void) pool_mgr;
+    (void) node;
+}
+
+/*
+ * Function Name: _mem_gap_ix_best_fit
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: node_pt
+ * Purpose: Returns the smallest gap that can hold size bytes, the
+ * lowest-addressed one among equals, or NULL if no gap is large enough.
+ * The gap index of a BEST_FIT pool is ordered by (size, address), so this
+ * takes a single descent.
+ */
+static void *_mem_gap_ix_best_fit(pool_mgr_pt pool_mgr, size_t size) {
+    node_pt best = NULL;
+    node_pt current = (*pool_mgr).gap_ix;
+    while(current != NULL){
+        if(current->alloc_record.size >= size){
+            best = current;
+            current = current->gap_left;
+        }
+        else{
+            current = current->gap_right;
+        }
+    }
+    return best;
+}
+
+/*
+ * Function Name: _mem_next_fit
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: node_pt
+ * Purpose: Walks the node list from the roving cursor, wrapping around to
+ * the first node, and returns the first gap that can hold size bytes or
+ * NULL once the walk is back where it started.
+ */
+static void *_mem_next_fit(pool_mgr_pt pool_mgr, size_t size) {
+    node_pt head = (*pool_mgr).head;
+    if(head == NULL){
+        return NULL;
+    }
+    node_pt start = ((*pool_mgr).rover != NULL) ? (*pool_mgr).rover : head;
+    node_pt current = start;
+    do {
+        if(current->allocated == 0 && current->alloc_record.size >= size){
+            return current;
+        }
+        current = (current->next != NULL) ? current->next : head;
+    } while(current != start);
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_gap_ix_first_fit
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: node_pt
+ * Purpose: Returns the lowest-addressed gap that can hold size bytes, or
+ * NULL if there is none. The gap index of a FIRST_FIT pool is ordered by
+ * address and every node knows the largest gap in its subtree, so the
+ * search goes left whenever the left subtree has a fitting gap.
+ */
+static void *_mem_gap_ix_first_fit(pool_mgr_pt pool_mgr, size_t size) {
+    node_pt current = (*pool_mgr).gap_ix;
+    if(_mem_gap_max(current) < size){
+        return NULL;
+    }
+    while(current != NULL){
+        if(_mem_gap_max(current->gap_left) >= size){
+            current = current->gap_left;
+        }
+        else if(current->alloc_record.size >= size){
+            return current;
+        }
+        else{
+            current = current->gap_right;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_tlsf_open
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t slot_size
+ * Return Type: alloc_status
+ * Purpose: Sets up the empty free lists before the node heap, whose first
+ * gap already goes into them.
+ */
+static alloc_status _mem_tlsf_open(pool_mgr_pt pool_mgr, size_t slot_size) {
+    (*pool_mgr).tlsf = (tlsf_pt) calloc(1, sizeof(tlsf_t));
+    if((*pool_mgr).tlsf == NULL){
+        return ALLOC_FAIL;
+    }
+    return _mem_nodes_open(pool_mgr, slot_size);
+}
+
+static void _mem_tlsf_close(pool_mgr_pt pool_mgr) {
+    free((*pool_mgr).tlsf);
+    _mem_nodes_close(pool_mgr);
+}
+
+/*
+ * Function Name: _mem_tlsf_mapping
+ * Passed Variables: size_t size, unsigned *fl, unsigned *sl
+ * Return Type: void
+ * Purpose: Maps a size onto its TLSF class. Sizes below
+ * MEM_TLSF_SL_COUNT get a class each (row 0), larger sizes are classed
+ * by their highest set bit (first level) and the MEM_TLSF_SL_LOG2 bits
+ * right below it (second level).
+ */
+static void _mem_tlsf_mapping(size_t size, unsigned *fl, unsigned *sl) {
+    if(size < MEM_TLSF_SL_COUNT){
+        *fl = 0;
+        *sl = (unsigned) size;
+        return;
+    }
+    unsigned msb = 63 - __builtin_clzll((unsigned long long) size);
+    *fl = msb - MEM_TLSF_SL_LOG2 + 1;
+    *sl = (unsigned) (size >> (msb - MEM_TLSF_SL_LOG2)) - MEM_TLSF_SL_COUNT;
+}
+
+/*
+ * Function Name: _mem_tlsf_insert
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: Pushes a gap on the free list of its size class and marks the
+ * class in both bitmaps.
+ */
+static void _mem_tlsf_insert(pool_mgr_pt pool_mgr, node_pt node) {
+    tlsf_pt tlsf = (*pool_mgr).tlsf;
+    unsigned fl, sl;
+    _mem_tlsf_mapping(node->alloc_record.size, &fl, &sl);
+    node->gap_left = NULL;
+    node->gap_right = tlsf->heads[fl][sl];
+    if(node->gap_right != NULL){
+        node->gap_right->gap_left = node;
+    }
+    tlsf->heads[fl][sl] = node;
+    tlsf->fl_bitmap |= 1ULL << fl;
+    tlsf->sl_bitmap[fl] |= 1U << sl;
+}
+
+/*
+ * Function Name: _mem_tlsf_remove
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: Unlinks a gap from its free list in constant time and clears
+ * the bitmap bits of a class that became empty.
+ */
+static void _mem_tlsf_remove(pool_mgr_pt pool_mgr, node_pt node) {
+    tlsf_pt tlsf = (*pool_mgr).tlsf;
+    unsigned fl, sl;
+    _mem_tlsf_mapping(node->alloc_record.size, &fl, &sl);
+    if(node->gap_left != NULL){
+        node->gap_left->gap_right = node->gap_right;
+    }
+    else{
+        tlsf->heads[fl][sl] = node->gap_right;
+    }
+    if(node->gap_right != NULL){
+        node->gap_right->gap_left = node->gap_left;
+    }
+    node->gap_left = node->gap_right = NULL;
+    if(tlsf->heads[fl][sl] == NULL){
+        tlsf->sl_bitmap[fl] &= ~(1U << sl);
+        if(tlsf->sl_bitmap[fl] == 0){
+            tlsf->fl_bitmap &= ~(1ULL << fl);
+        }
+    }
+}
+
+/*
+ * Function Name: _mem_tlsf_find
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: void *
+ * Purpose: Finds a gap of at least size bytes. The size is rounded up to
+ * the next class boundary so that any gap of the class found by the
+ * find-first-set lookups fits, which makes the search constant time.
+ * Only if no such class exists are the first MEM_TLSF_PROBES gaps of the
+ * (unrounded) class of size itself tried, so that a request for the
+ * largest gap usually does not fail while the cost stays bounded; a fit
+ * further down that list is missed and the request fails.
+ */
+static void *_mem_tlsf_find(pool_mgr_pt pool_mgr, size_t size) {
+    tlsf_pt tlsf = (*pool_mgr).tlsf;
+    unsigned fl, sl;
+    size_t rounded = size;
+    if(size >= MEM_TLSF_SL_COUNT){
+        rounded += (1ULL << (63 - __builtin_clzll((unsigned long long) size) - MEM_TLSF_SL_LOG2)) - 1;
+    }
+    /* (a rounding overflow leaves nothing larger to look for) */
+    if(rounded >= size){
+        _mem_tlsf_mapping(rounded, &fl, &sl);
+        /* the rest of the row first, then the next non-empty row */
+        unsigned sl_map = tlsf->sl_bitmap[fl] & (~0U << sl);
+        if(sl_map == 0){
+            unsigned long long fl_map = tlsf->fl_bitmap & (~0ULL << (fl + 1));
+            if(fl_map != 0){
+                fl = __builtin_ctzll(fl_map);
+                sl_map = tlsf->sl_bitmap[fl];
+            }
+        }
+        if(sl_map != 0){
+            return tlsf->heads[fl][__builtin_ctz(sl_map)];
+        }
+    }
+    /* Last resort: the gaps sharing the class of size may still be big enough */
+    _mem_tlsf_mapping(size, &fl, &sl);
+    node_pt node = tlsf->heads[fl][sl];
+    for(unsigned probes = 0; node != NULL && probes < MEM_TLSF_PROBES; node = node->gap_right, ++probes){
+        if(node->alloc_record.size >= size){
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_acquire_node
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: node_pt
+ * Purpose: Grows the node heap if needed and pops an unused node off the
+ * free node list, already counted in used_nodes. The most recently
+ * released node comes first since it is the most likely to be cached.
+ * Returns NULL if the node heap cannot grow.
+ */
+static node_pt _mem_acquire_node(pool_mgr_pt pool_mgr) {
+    if(_mem_resize_node_heap(pool_mgr) == ALLOC_FAIL || (*pool_mgr).free_nodes == NULL){
+        return NULL;
+    }
+    node_pt node = (*pool_mgr).free_nodes;
+    (*pool_mgr).free_nodes = node->next;
+    node->next = NULL;
+    node->prev = NULL;
+    node->used = 1;
+    (*pool_mgr).used_nodes++;
+    return node;
+}
+
+/*
+ * Function Name: _mem_release_node
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: Marks a node that was unlinked from the node list as unused
+ * and pushes it on the free node list.
+ */
+static void _mem_release_node(pool_mgr_pt pool_mgr, node_pt node) {
+    /* a node is only released after merging into its predecessor */
+    if((*pool_mgr).rover == node){
+        (*pool_mgr).rover = node->prev;
+    }
+    if((*pool_mgr).tail == node){
+        (*pool_mgr).tail = node->prev;
+    }
+    node->used = 0;
+    node->allocated = 0;
+    node->prev = NULL;
+    node->next = (*pool_mgr).free_nodes;
+    (*pool_mgr).free_nodes = node;
+    (*pool_mgr).used_nodes--;
+}
+
+/*
+ * Function Name: _mem_nodes_track_tail
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: Called for a node just linked into the node list, which is
+ * the new tail if nothing follows it. _mem_release_node moves the tail
+ * back when the last node merges into its predecessor.
+ */
+static void _mem_nodes_track_tail(pool_mgr_pt pool_mgr, node_pt node) {
+    if(node->next == NULL){
+        (*pool_mgr).tail = node;
+    }
+}
+
+/*
+ * Function Name: _mem_node_heap_open
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: alloc_status
+ * Purpose: Allocates the first chunk of the node heap. Node 0 covers the
+ * whole pool and every other node starts out on the free node list. The
+ * caller decides how node 0 goes into the gap index.
+ */
+static alloc_status _mem_node_heap_open(pool_mgr_pt pool_mgr) {
+	(*pool_mgr).node_heap[0] = calloc(MEM_NODE_HEAP_INIT_CAPACITY, sizeof(node_t));
+	if ((*pool_mgr).node_heap[0] == NULL){
+		return ALLOC_FAIL;
+	}
+	(*pool_mgr).node_heap_chunks = 1;
+	//Initialize all gap and node members.
+	//Every node but the first one starts out on the free node list
+	(*pool_mgr).free_nodes = NULL;
+	for (unsigned i = MEM_NODE_HEAP_INIT_CAPACITY; i-- > 0; ){
+		(*pool_mgr).node_heap[0][i].ix = i;
+		if (i > 0){
+			(*pool_mgr).node_heap[0][i].next = (*pool_mgr).free_nodes;
+			(*pool_mgr).free_nodes = &(*pool_mgr).node_heap[0][i];
+		}
+	}
+	(*pool_mgr).total_nodes = MEM_NODE_HEAP_INIT_CAPACITY;
+	(*pool_mgr).used_nodes = 1;
+    //the whole pool starts out as a single gap
+    node_pt first = _mem_node_at(pool_mgr, 0);
+    first->alloc_record.size = (*pool_mgr).pool.total_size;
+    first->alloc_record.mem = (*pool_mgr).pool.mem;
+    first->allocated = 0;
+    first->used = 1;
+    first->prev = NULL;
+    first->next = NULL;
+    (*pool_mgr).head = first;
+    (*pool_mgr).tail = first;
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_nodes_open
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t slot_size
+ * Return Type: alloc_status
+ * Purpose: Opens the node heap and indexes the whole pool as one gap.
+ * This is the open of every policy that cuts gaps out of the node list.
+ */
+static alloc_status _mem_nodes_open(pool_mgr_pt pool_mgr, size_t slot_size) {
+    (void) slot_size;
+    if(_mem_node_heap_open(pool_mgr) != ALLOC_OK){
+        return ALLOC_FAIL;
+    }
+    node_pt first = (*pool_mgr).head;
+    return _mem_add_to_gap_ix(pool_mgr, first->alloc_record.size, first);
+}
+
+/*
+ * Function Name: _mem_nodes_close
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: Frees the node heap, chunk by chunk. Also cleans up after an
+ * open that failed half way.
+ */
+static void _mem_nodes_close(pool_mgr_pt pool_mgr) {
+	for (unsigned i = 0; i < MEM_NODE_HEAP_MAX_CHUNKS; ++i){
+		free((*pool_mgr).node_heap[i]);
+		(*pool_mgr).node_heap[i] = NULL;
+	}
+}
+
+/*
+ * Function Name: _mem_nodes_split
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block, size_t size
+ * Return Type: alloc_pt
+ * Purpose: Turns the front of a gap into an allocation of size bytes.
+ * Whatever is left becomes a new gap right after it, both in memory and
+ * in the node list. The allocation keeps the gap's start address; the
+ * pool memory is carved, never malloc'd.
+ */
+static alloc_pt _mem_nodes_split(pool_mgr_pt pool_mgr, void *block, size_t size) {
+    node_pt newNode = (node_pt) block;
+    //Calculate the remaining gap space
+    size_t remainSpace = newNode->alloc_record.size - size;
+    /* The remainder gap needs a node of its own, get it before anything changes */
+    node_pt gap_Node = NULL;
+    if(remainSpace != 0) {
+        gap_Node = _mem_acquire_node(pool_mgr);
+        if(gap_Node == NULL){
+            return NULL;
+        }
+    }
+    /* remove the node from the gap index */
+    if(_mem_remove_from_gap_ix(pool_mgr,size,newNode) != ALLOC_OK){
+        if(gap_Node != NULL){
+            _mem_release_node(pool_mgr, gap_Node);
+        }
+        return NULL;
+    }
+    pool_mgr->pool.num_allocs++;//Change the amount of allocations to the pool
+    pool_mgr->pool.alloc_size += size;
+    _mem_decay_live(pool_mgr, newNode->alloc_record.mem, size, 1);
+    /* Alter the nodes values */
+    newNode->used = 1;
+    newNode->allocated = 1;
+    newNode->alloc_record.size = size;
+    if(remainSpace != 0) {
+        /* the remainder gap starts right after the new allocation */
+        gap_Node->alloc_record.mem = newNode->alloc_record.mem + size;
+        /* add this node to the gap index with the leftover size from the alloc. */
+        _mem_add_to_gap_ix(pool_mgr, remainSpace, gap_Node);
+        /* Have the nodes start to point to one another */
+        if (newNode->next != NULL) {
+            node_pt next = newNode->next;
+            gap_Node->next = next;
+            next->prev = gap_Node;
+        }
+        else {
+            gap_Node->next = NULL;
+        }
+
+        newNode->next = gap_Node;
+        gap_Node->prev = newNode;
+        _mem_nodes_track_tail(pool_mgr, gap_Node);
+    }
+    /* the next search starts right after this allocation */
+    pool_mgr->rover = newNode->next;
+
+    return (alloc_pt) newNode;
+}
+
+/*
+ * Function Name: _mem_nodes_split_run
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block, const size_t *sizes,
+ *                   alloc_pt *allocs, unsigned num
+ * Return Type: alloc_status
+ * Purpose: Carves num allocations back to back out of the front of a gap
+ * at least as large as their total, with one update of the gap index.
+ * All the nodes are taken before anything changes, so on ALLOC_FAIL the
+ * pool is as it was.
+ */
+static alloc_status _mem_nodes_split_run(pool_mgr_pt pool_mgr, void *block,
+                                         const size_t *sizes, alloc_pt *allocs, unsigned num) {
+    node_pt gap = (node_pt) block;
+    size_t total = 0;
+    for(unsigned i = 0; i < num; ++i){
+        total += sizes[i];
+    }
+    /* The first allocation reuses the gap's node, the others and the
+     * remainder gap need nodes of their own */
+    unsigned num_nodes = num - 1 + (gap->alloc_record.size != total);
+    node_pt fresh = NULL;
+    for(unsigned i = 0; i < num_nodes; ++i){
+        node_pt node = _mem_acquire_node(pool_mgr);
+        if(node == NULL){
+            while(fresh != NULL){
+                node = fresh;
+                fresh = fresh->next;
+                _mem_release_node(pool_mgr, node);
+            }
+            return ALLOC_FAIL;
+        }
+        node->next = fresh;
+        fresh = node;
+    }
+    size_t remainSpace = gap->alloc_record.size - total;
+    node_pt after = gap->next;
+    if(_mem_remove_from_gap_ix(pool_mgr, total, gap) != ALLOC_OK){
+        while(fresh != NULL){
+            node_pt node = fresh;
+            fresh = fresh->next;
+            _mem_release_node(pool_mgr, node);
+        }
+        return ALLOC_FAIL;
+    }
+    /* Lay the allocations out in the order they were asked for */
+    node_pt prev = gap;
+    char *mem = gap->alloc_record.mem;
+    for(unsigned i = 0; i < num; ++i){
+        node_pt node = gap;
+        if(i > 0){
+            node = fresh;
+            fresh = fresh->next;
+            node->prev = prev;
+            prev->next = node;
+        }
+        node->used = 1;
+        node->allocated = 1;
+        node->alloc_record.mem = mem;
+        node->alloc_record.size = sizes[i];
+        mem += sizes[i];
+        allocs[i] = (alloc_pt) node;
+        prev = node;
+    }
+    pool_mgr->pool.num_allocs += num;
+    pool_mgr->pool.alloc_size += total;
+    _mem_decay_live(pool_mgr, gap->alloc_record.mem, total, 1);
+    if(remainSpace != 0){
+        /* the remainder gap starts right after the last allocation */
+        node_pt gap_Node = fresh;
+        gap_Node->alloc_record.mem = mem;
+        gap_Node->prev = prev;
+        prev->next = gap_Node;
+        prev = gap_Node;
+        _mem_add_to_gap_ix(pool_mgr, remainSpace, gap_Node);
+    }
+    prev->next = after;
+    if(after != NULL){
+        after->prev = prev;
+    }
+    _mem_nodes_track_tail(pool_mgr, prev);
+    /* the next search starts right after the run */
+    pool_mgr->rover = ((node_pt) allocs[num - 1])->next;
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_nodes_release
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: void *
+ * Purpose: Checks that alloc is a live allocation of this pool and turns
+ * it into an unindexed gap. Returns its node, or NULL if it is foreign.
+ */
+static void *_mem_nodes_release(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    node_pt node = _mem_nodes_live(pool_mgr, alloc);
+    if(node == NULL){
+        return NULL;
+    }
+
+    // convert to gap node; no lock-free free may claim it any more
+    node->allocated = 0;
+    atomic_store_explicit(&node->handed_out, 0, memory_order_relaxed);
+
+    // update metadata (num_allocs, alloc_size)
+    pool_mgr->pool.num_allocs--;
+    pool_mgr->pool.alloc_size -= node->alloc_record.size;
+    _mem_decay_live(pool_mgr, node->alloc_record.mem, node->alloc_record.size, 0);
+    return node;
+}
+
+/*
+ * Function Name: _mem_nodes_live
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: node_pt
+ * Purpose: Returns the node of alloc if it is a live allocation of this
+ * pool, NULL otherwise.
+ */
+static node_pt _mem_nodes_live(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    // get node from alloc by casting the pointer to (node_pt)
+    node_pt node = (node_pt) alloc;
+
+    // the node knows its index in the node heap; the node at that index
+    // must be the node itself, otherwise the allocation is not ours
+    if(node == NULL || node->ix >= pool_mgr->total_nodes || _mem_node_at(pool_mgr, node->ix) != node){
+        return NULL;
+    }
+    // make sure it's a live allocation
+    if(node->used == 0 || node->allocated == 0){
+        return NULL;
+    }
+    return node;
+}
+
+/*
+ * Function Name: _mem_nodes_claim
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: node_pt
+ * Purpose: Takes alloc back from the user of a POOL_THREAD_CACHE or
+ * POOL_OWNED pool without the lock. The chunk the node's index names is
+ * looked up first, so nothing is written to a record that is not a node
+ * of this pool; then the handed-out mark is cleared in one exchange,
+ * which only one free of the block can win. Returns the node, or NULL
+ * for a foreign record, a gap or a block that was freed already.
+ */
+static node_pt _mem_nodes_claim(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    node_pt node = (node_pt) alloc;
+    if(node == NULL){
+        return NULL;
+    }
+    unsigned ix = node->ix;
+    unsigned quot = ix / MEM_NODE_HEAP_INIT_CAPACITY;
+    unsigned chunk = (quot == 0) ? 0 : 32 - __builtin_clz(quot);
+    unsigned first = (chunk == 0) ? 0 : MEM_NODE_HEAP_INIT_CAPACITY << (chunk - 1);
+    if(chunk >= MEM_NODE_HEAP_MAX_CHUNKS){
+        return NULL;
+    }
+    node_pt base = __atomic_load_n(&(*pool_mgr).node_heap[chunk], __ATOMIC_ACQUIRE);
+    if(base == NULL || &base[ix - first] != node){
+        return NULL;
+    }
+    if(atomic_exchange_explicit(&node->handed_out, 0, memory_order_relaxed) != 1){
+        return NULL;
+    }
+    return node;
+}
+
+/*
+ * Function Name: _mem_nodes_adjacent
+ * Passed Variables: node_pt node, node_pt next
+ * Return Type: int
+ * Purpose: Whether next starts where node ends. Nodes that follow each
+ * other in the node list only do not at the border of two regions of a
+ * POOL_GROWABLE pool.
+ */
+static int _mem_nodes_adjacent(node_pt node, node_pt next) {
+    return node->alloc_record.mem + node->alloc_record.size == next->alloc_record.mem;
+}
+
+/*
+ * Function Name: _mem_nodes_resize
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size
+ * Return Type: alloc_status
+ * Purpose: Moves the boundary between an allocation and the gap after
+ * it. A shrunk allocation's tail joins that gap, or becomes a gap of its
+ * own if an allocation follows; a grown one needs the gap to be large
+ * enough, otherwise nothing changes and ALLOC_NOT_FREED is returned.
+ */
+static alloc_status _mem_nodes_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size) {
+    node_pt node = _mem_nodes_live(pool_mgr, alloc);
+    if(node == NULL){
+        return ALLOC_FAIL;
+    }
+    size_t old_size = node->alloc_record.size;
+    node_pt next = node->next;
+    int next_gap = (next != NULL && next->allocated == 0 && _mem_nodes_adjacent(node, next));
+    if(size < old_size){
+        size_t tail = old_size - size;
+        if(next_gap){
+            // the gap after it starts earlier now
+            if(_mem_remove_from_gap_ix(pool_mgr, 0, next) == ALLOC_FAIL)
+                return ALLOC_FAIL;
+            next->alloc_record.mem -= tail;
+            _mem_add_to_gap_ix(pool_mgr, next->alloc_record.size + tail, next);
+        }
+        else{
+            node_pt gap_Node = _mem_acquire_node(pool_mgr);
+            if(gap_Node == NULL){
+                return ALLOC_NOT_FREED;
+            }
+            gap_Node->alloc_record.mem = node->alloc_record.mem + size;
+            gap_Node->prev = node;
+            gap_Node->next = next;
+            if(next != NULL){
+                next->prev = gap_Node;
+            }
+            node->next = gap_Node;
+            _mem_nodes_track_tail(pool_mgr, gap_Node);
+            _mem_add_to_gap_ix(pool_mgr, tail, gap_Node);
+        }
+        pool_mgr->pool.alloc_size -= tail;
+        _mem_decay_live(pool_mgr, node->alloc_record.mem + size, tail, 0);
+    }
+    else if(size > old_size){
+        size_t grow = size - old_size;
+        if(!next_gap || next->alloc_record.size < grow){
+            return ALLOC_NOT_FREED;
+        }
+        if(_mem_remove_from_gap_ix(pool_mgr, 0, next) == ALLOC_FAIL)
+            return ALLOC_FAIL;
+        if(next->alloc_record.size == grow){
+            // the gap is used up
+            node->next = next->next;
+            if(next->next != NULL){
+                next->next->prev = node;
+            }
+            _mem_release_node(pool_mgr, next);
+        }
+        else{
+            next->alloc_record.mem += grow;
+            _mem_add_to_gap_ix(pool_mgr, next->alloc_record.size - grow, next);
+        }
+        pool_mgr->pool.alloc_size += grow;
+        _mem_decay_live(pool_mgr, node->alloc_record.mem + old_size, grow, 1);
+    }
+    node->alloc_record.size = size;
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_align_pad
+ * Passed Variables: const char *mem, size_t alignment
+ * Return Type: size_t
+ * Purpose: The number of bytes from mem up to the next multiple of
+ * alignment, a power of two.
+ */
+static size_t _mem_align_pad(const char *mem, size_t alignment) {
+    return (size_t) (-(uintptr_t) mem & (alignment - 1));
+}
+
+/*
+ * Function Name: _mem_nodes_find_aligned
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size, size_t alignment
+ * Return Type: void *
+ * Purpose: Finds a gap that holds size bytes from its first aligned
+ * address on, asking the policy for a gap large enough for the worst
+ * case padding if the first fit is not.
+ */
+static void *_mem_nodes_find_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment) {
+    node_pt gap = (node_pt) pool_mgr->policy->find(pool_mgr, size);
+    if(gap != NULL && _mem_align_pad(gap->alloc_record.mem, alignment) > gap->alloc_record.size - size){
+        gap = NULL;
+        if(size <= SIZE_MAX - (alignment - 1)){
+            gap = (node_pt) pool_mgr->policy->find(pool_mgr, size + alignment - 1);
+        }
+    }
+    if(gap == NULL){
+        return NULL;
+    }
+    return _mem_nodes_align_gap(pool_mgr, gap, alignment);
+}
+
+/*
+ * Function Name: _mem_nodes_align_gap
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt gap, size_t alignment
+ * Return Type: void *
+ * Purpose: Splits the padding up to the first aligned address off the
+ * front of a gap and returns the gap that starts there, or NULL if no
+ * node can be had. A node for the split that follows is set aside so
+ * that two gaps are never left side by side.
+ */
+static void *_mem_nodes_align_gap(pool_mgr_pt pool_mgr, node_pt gap, size_t alignment) {
+    size_t pad = _mem_align_pad(gap->alloc_record.mem, alignment);
+    if(pad == 0){
+        return gap;
+    }
+    node_pt aligned = _mem_acquire_node(pool_mgr);
+    node_pt spare = (aligned != NULL) ? _mem_acquire_node(pool_mgr) : NULL;
+    if(spare == NULL){
+        if(aligned != NULL){
+            _mem_release_node(pool_mgr, aligned);
+        }
+        return NULL;
+    }
+    _mem_release_node(pool_mgr, spare);
+    if(_mem_remove_from_gap_ix(pool_mgr, 0, gap) == ALLOC_FAIL){
+        _mem_release_node(pool_mgr, aligned);
+        return NULL;
+    }
+    size_t gap_size = gap->alloc_record.size;
+    aligned->alloc_record.mem = gap->alloc_record.mem + pad;
+    aligned->prev = gap;
+    aligned->next = gap->next;
+    if(gap->next != NULL){
+        gap->next->prev = aligned;
+    }
+    gap->next = aligned;
+    _mem_nodes_track_tail(pool_mgr, aligned);
+    _mem_add_to_gap_ix(pool_mgr, pad, gap);
+    _mem_add_to_gap_ix(pool_mgr, gap_size - pad, aligned);
+    return aligned;
+}
+
+/*
+ * Function Name: _mem_nodes_coalesce
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block
+ * Return Type: alloc_status
+ * Purpose: Merges a released node with the gaps right before and after
+ * it and adds the resulting gap to the gap index.
+ */
+static alloc_status _mem_nodes_coalesce(pool_mgr_pt pool_mgr, void *block) {
+    // this is node-to-delete
+    node_pt del_node = (node_pt) block;
+
+    // if the next node in the list is also a gap, merge into node-to-delete
+    if(del_node->next != NULL && del_node->next->allocated == 0 &&
+       _mem_nodes_adjacent(del_node, del_node->next)) {
+        node_pt next = del_node->next;
+        //   remove the next node from gap index
+        if(_mem_remove_from_gap_ix(pool_mgr, 0, next) == ALLOC_FAIL)
+            return ALLOC_FAIL;
+
+        //   add the size to the node-to-delete
+        del_node->alloc_record.size += next->alloc_record.size;
+        //   update linked list:
+        if (next->next) {
+            next->next->prev = del_node;
+            del_node->next = next->next;
+        } else {
+            del_node->next = NULL;
+        }
+        //   recycle the node (updates used nodes)
+        _mem_release_node(pool_mgr, next);
+    }
+    // this merged node-to-delete might need to be added to the gap index
+    // but one more thing to check...
+    // if the previous node in the list is also a gap, merge into previous!
+    if(del_node->prev!= NULL && del_node->prev->allocated == 0 &&
+       _mem_nodes_adjacent(del_node->prev, del_node)) {
+        //   remove the previous node from gap index
+        node_pt previous = del_node->prev;
+        if(_mem_remove_from_gap_ix(pool_mgr, 0, previous) == ALLOC_FAIL)
+            return ALLOC_FAIL;
+
+        //   add the size of node-to-delete to the previous
+        previous->alloc_record.size += del_node->alloc_record.size;
+        //   update linked list
+        if (del_node->next) {
+            previous->next = del_node->next;
+            del_node->next->prev = previous;
+        } else {
+            previous->next = NULL;
+        }
+        //   recycle node-to-delete (updates used_nodes)
+        _mem_release_node(pool_mgr, del_node);
+
+        //   change the node to add to the previous node!
+        del_node = previous;
+    }
+    // add the resulting node to the gap index
+    // check success
+    if(_mem_add_to_gap_ix(pool_mgr, del_node->alloc_record.size,del_node ) != ALLOC_OK)
+        return ALLOC_FAIL;
+
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_nodes_coalesce_run
+ * Passed Variables: pool_mgr_pt pool_mgr, void **blocks, unsigned num
+ * Return Type: alloc_status
+ * Purpose: Merges released nodes, sorted by address, with each other and
+ * with the gaps around them. Every run of neighbouring free nodes becomes
+ * a single gap that is added to the gap index once. A free node right
+ * after a run is either the next released node or an indexed gap.
+ */
+static alloc_status _mem_nodes_coalesce_run(pool_mgr_pt pool_mgr, void **blocks, unsigned num) {
+    unsigned i = 0;
+    while(i < num){
+        node_pt run = (node_pt) blocks[i++];
+        // a gap before the run is already indexed, the run merges into it
+        if(run->prev != NULL && run->prev->allocated == 0 && _mem_nodes_adjacent(run->prev, run)){
+            node_pt previous = run->prev;
+            if(_mem_remove_from_gap_ix(pool_mgr, 0, previous) == ALLOC_FAIL)
+                return ALLOC_FAIL;
+            previous->alloc_record.size += run->alloc_record.size;
+            previous->next = run->next;
+            if(run->next != NULL){
+                run->next->prev = previous;
+            }
+            _mem_release_node(pool_mgr, run);
+            run = previous;
+        }
+        // swallow free nodes until the next allocation
+        while(run->next != NULL && run->next->allocated == 0 && _mem_nodes_adjacent(run, run->next)){
+            node_pt next = run->next;
+            if(i < num && blocks[i] == next){
+                ++i;
+            }
+            else if(_mem_remove_from_gap_ix(pool_mgr, 0, next) == ALLOC_FAIL){
+                return ALLOC_FAIL;
+            }
+            run->alloc_record.size += next->alloc_record.size;
+            run->next = next->next;
+            if(next->next != NULL){
+                next->next->prev = run;
+            }
+            _mem_release_node(pool_mgr, next);
+        }
+        if(_mem_add_to_gap_ix(pool_mgr, run->alloc_record.size, run) != ALLOC_OK)
+            return ALLOC_FAIL;
+    }
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_block_cmp_address
+ * Passed Variables: const void *a, const void *b
+ * Return Type: int
+ * Purpose: qsort comparison of two released blocks by address. Every
+ * block starts with the allocation record it was released from.
+ */
+static int _mem_block_cmp_address(const void *a, const void *b) {
+    char *mem_a = (*(alloc_pt const *) a)->mem;
+    char *mem_b = (*(alloc_pt const *) b)->mem;
+    return (mem_a > mem_b) - (mem_a < mem_b);
+}
+
+/*
+ * Function Name: _mem_nodes_inspect
+ * Passed Variables: pool_mgr_pt pool_mgr, pool_segment_pt segs
+ * Return Type: unsigned
+ * Purpose: Writes one segment per used node, in node list order, and
+ * returns their number. With segs NULL only the number is returned.
+ */
+static unsigned _mem_nodes_inspect(pool_mgr_pt pool_mgr, pool_segment_pt segs) {
+    if(segs == NULL){
+        return pool_mgr->used_nodes;
+    }
+    node_pt current = pool_mgr->head;
+
+    // loop through the node heap and the segments array
+    for(int i = 0; i < pool_mgr->used_nodes; ++i){
+        //    for each node, write the size and allocated in the segment
+        segs[i].size = current->alloc_record.size;
+        segs[i].allocated = current->allocated;
+        if(current->next != NULL) {
+            current = current->next;
+        }
+    }
+    return pool_mgr->used_nodes;
+}
+
+/*
+ * Function Name: _mem_nodes_rebuild
+ * Passed Variables: pool_mgr_pt pool_mgr, const pool_segment_t *segs, unsigned num
+ * Return Type: alloc_status
+ * Purpose: Lays the segments, in address order, over a pool that is
+ * still one gap, the way _mem_nodes_inspect wrote them out. Gaps that
+ * follow each other become one and empty gaps are dropped. Fails if the
+ * segments do not add up to the pool or a node cannot be had, and then
+ * leaves a pool that can only be destroyed.
+ */
+static alloc_status _mem_nodes_rebuild(pool_mgr_pt pool_mgr, const pool_segment_t *segs, unsigned num) {
+    size_t total = 0;
+    for(unsigned i = 0; i < num; ++i){
+        if(segs[i].allocated > 1 || segs[i].size > pool_mgr->pool.total_size - total){
+            return ALLOC_FAIL;
+        }
+        total += segs[i].size;
+    }
+    if(total != pool_mgr->pool.total_size){
+        return ALLOC_FAIL;
+    }
+    node_pt first = pool_mgr->head;
+    _mem_remove_from_gap_ix(pool_mgr, first->alloc_record.size, first);
+
+    char *mem = pool_mgr->pool.mem;
+    node_pt last = NULL;
+    for(unsigned i = 0; i < num; mem += segs[i].size, ++i){
+        if(segs[i].allocated == 0 && (segs[i].size == 0 || (last != NULL && last->allocated == 0))){
+            if(last != NULL){
+                last->alloc_record.size += segs[i].size;
+            }
+            continue;
+        }
+        node_pt node = (last == NULL) ? first : _mem_acquire_node(pool_mgr);
+        if(node == NULL){
+            return ALLOC_FAIL;
+        }
+        node->alloc_record.mem = mem;
+        node->alloc_record.size = segs[i].size;
+        node->allocated = (unsigned) segs[i].allocated;
+        node->used = 1;
+        node->prev = last;
+        node->next = NULL;
+        if(last != NULL){
+            last->next = node;
+        }
+        _mem_nodes_track_tail(pool_mgr, node);
+        last = node;
+        if(node->allocated){
+            pool_mgr->pool.num_allocs++;
+            pool_mgr->pool.alloc_size += node->alloc_record.size;
+            _mem_decay_live(pool_mgr, node->alloc_record.mem, node->alloc_record.size, 1);
+        }
+    }
+    // gaps only go into the index once their size is final
+    for(node_pt node = first; node != NULL; node = node->next){
+        if(node->allocated == 0){
+            _mem_add_to_gap_ix(pool_mgr, node->alloc_record.size, node);
+        }
+    }
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_buddy_insert, _mem_buddy_remove
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: void
+ * Purpose: Push a gap on / unlink a gap from the free list of its order
+ * and keep the order bitmap in step.
+ */
+static void _mem_buddy_insert(pool_mgr_pt pool_mgr, node_pt node) {
+    buddy_pt buddy = (*pool_mgr).buddy;
+    unsigned order = __builtin_ctzll((unsigned long long) node->alloc_record.size);
+    node->gap_left = NULL;
+    node->gap_right = buddy->heads[order];
+    if(node->gap_right != NULL){
+        node->gap_right->gap_left = node;
+    }
+    buddy->heads[order] = node;
+    buddy->order_bitmap |= 1ULL << order;
+}
+
+static void _mem_buddy_remove(pool_mgr_pt pool_mgr, node_pt node) {
+    buddy_pt buddy = (*pool_mgr).buddy;
+    unsigned order = __builtin_ctzll((unsigned long long) node->alloc_record.size);
+    if(node->gap_left != NULL){
+        node->gap_left->gap_right = node->gap_right;
+    }
+    else{
+        buddy->heads[order] = node->gap_right;
+    }
+    if(node->gap_right != NULL){
+        node->gap_right->gap_left = node->gap_left;
+    }
+    node->gap_left = node->gap_right = NULL;
+    if(buddy->heads[order] == NULL){
+        buddy->order_bitmap &= ~(1ULL << order);
+    }
+}
+
+/*
+ * Function Name: _mem_buddy_halve
+ * Passed Variables: pool_mgr_pt pool_mgr, node_pt node
+ * Return Type: alloc_status
+ * Purpose: Halves a block that is not in any free list. The upper half
+ * becomes a new gap node right after it in the node list and goes into
+ * the free list of its order.
+ */
+static alloc_status _mem_buddy_halve(pool_mgr_pt pool_mgr, node_pt node) {
+    node_pt upper = _mem_acquire_node(pool_mgr);
+    if(upper == NULL){
+        return ALLOC_FAIL;
+    }
+    size_t half = node->alloc_record.size / 2;
+    node->alloc_record.size = half;
+    upper->alloc_record.mem = node->alloc_record.mem + half;
+    upper->next = node->next;
+    if(upper->next != NULL){
+        upper->next->prev = upper;
+    }
+    upper->prev = node;
+    node->next = upper;
+    _mem_nodes_track_tail(pool_mgr, upper);
+    return _mem_add_to_gap_ix(pool_mgr, half, upper);
+}
+
+/*
+ * Function Name: _mem_buddy_open
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t slot_size
+ * Return Type: alloc_status
+ * Purpose: Carves a fresh pool into the largest power-of-two blocks it
+ * holds, in decreasing order, so that every block is aligned to its own
+ * size relative to pool.mem. Pools that are not a power of two in size
+ * therefore start out with one gap per set bit of their size.
+ */
+static alloc_status _mem_buddy_open(pool_mgr_pt pool_mgr, size_t slot_size) {
+    (void) slot_size;
+    (*pool_mgr).buddy = (buddy_pt) calloc(1, sizeof(buddy_t));
+    if((*pool_mgr).buddy == NULL || _mem_node_heap_open(pool_mgr) != ALLOC_OK){
+        return ALLOC_FAIL;
+    }
+    size_t rest = (*pool_mgr).pool.total_size;
+    node_pt node = (*pool_mgr).head;
+    node_pt prev = NULL;
+    char *mem = (*pool_mgr).pool.mem;
+    while(rest != 0){
+        size_t block = 1ULL << (63 - __builtin_clzll((unsigned long long) rest));
+        if(node == NULL){
+            node = _mem_acquire_node(pool_mgr);
+            if(node == NULL){
+                return ALLOC_FAIL;
+            }
+        }
+        node->alloc_record.mem = mem;
+        node->prev = prev;
+        node->next = NULL;
+        if(prev != NULL){
+            prev->next = node;
+        }
+        _mem_nodes_track_tail(pool_mgr, node);
+        if(_mem_add_to_gap_ix(pool_mgr, block, node) == ALLOC_FAIL){
+            return ALLOC_FAIL;
+        }
+        mem += block;
+        rest -= block;
+        prev = node;
+        node = NULL;
+    }
+    return ALLOC_OK;
+}
+
+static void _mem_buddy_close(pool_mgr_pt pool_mgr) {
+    free((*pool_mgr).buddy);
+    _mem_nodes_close(pool_mgr);
+}
+
+/*
+ * Function Name: _mem_buddy_find
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: void *
+ * Purpose: Rounds the request up to a power of two and returns a block of
+ * the smallest non-empty order that is large enough, found with one
+ * find-first-set on the order bitmap.
+ */
+static void *_mem_buddy_find(pool_mgr_pt pool_mgr, size_t size) {
+    buddy_pt buddy = (*pool_mgr).buddy;
+    unsigned order = MEM_BUDDY_MIN_ORDER;
+    while(order < MEM_BUDDY_ORDERS && (1ULL << order) < size){
+        ++order;
+    }
+    if(order >= MEM_BUDDY_ORDERS){
+        return NULL;
+    }
+    unsigned long long orders = buddy->order_bitmap & (~0ULL << order);
+    if(orders == 0){
+        return NULL;
+    }
+    return buddy->heads[__builtin_ctzll(orders)];
+}
+
+/*
+ * Function Name: _mem_buddy_split
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block, size_t size
+ * Return Type: alloc_pt
+ * Purpose: Halves the block until it has the order of the rounded request
+ * and hands it out whole.
+ */
+static alloc_pt _mem_buddy_split(pool_mgr_pt pool_mgr, void *block, size_t size) {
+    node_pt node = (node_pt) block;
+    unsigned order = MEM_BUDDY_MIN_ORDER;
+    while((1ULL << order) < size){
+        ++order;
+    }
+    if(_mem_remove_from_gap_ix(pool_mgr, 0, node) == ALLOC_FAIL){
+        return NULL;
+    }
+    node->allocated = 1;
+    while(node->alloc_record.size > (1ULL << order)){
+        if(_mem_buddy_halve(pool_mgr, node) == ALLOC_FAIL){
+            /* give back what is left of the block, merging the halves again */
+            node->allocated = 0;
+            _mem_buddy_coalesce(pool_mgr, node);
+            return NULL;
+        }
+    }
+    (*pool_mgr).pool.num_allocs++;
+    (*pool_mgr).pool.alloc_size += node->alloc_record.size;
+    _mem_decay_live(pool_mgr, node->alloc_record.mem, node->alloc_record.size, 1);
+    return (alloc_pt) node;
+}
+
+/*
+ * Function Name: _mem_buddy_coalesce
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block
+ * Return Type: alloc_status
+ * Purpose: Turns a block back into a gap, merging it with its buddy for
+ * as long as the buddy is a whole free block. The buddy of the block at
+ * offset o and size s is at offset o ^ s, which makes it either the
+ * node right before or right after it, so each merge costs O(1).
+ */
+static alloc_status _mem_buddy_coalesce(pool_mgr_pt pool_mgr, void *block) {
+    node_pt node = (node_pt) block;
+    for(;;){
+        size_t size = node->alloc_record.size;
+        size_t offset = (size_t) (node->alloc_record.mem - (*pool_mgr).pool.mem);
+        char *buddy_mem = (*pool_mgr).pool.mem + (offset ^ size);
+        node_pt buddy = (offset & size) ? node->prev : node->next;
+        if(buddy == NULL || buddy->allocated || buddy->alloc_record.mem != buddy_mem ||
+           buddy->alloc_record.size != size){
+            break;
+        }
+        if(_mem_remove_from_gap_ix(pool_mgr, 0, buddy) == ALLOC_FAIL){
+            return ALLOC_FAIL;
+        }
+        /* the lower block absorbs the upper one */
+        node_pt lower = (buddy_mem < node->alloc_record.mem) ? buddy : node;
+        node_pt upper = (lower == node) ? buddy : node;
+        lower->alloc_record.size = 2 * size;
+        lower->next = upper->next;
+        if(lower->next != NULL){
+            lower->next->prev = lower;
+        }
+        _mem_release_node(pool_mgr, upper);
+        node = lower;
+    }
+    return _mem_add_to_gap_ix(pool_mgr, node->alloc_record.size, node);
+}
+
+/*
+ * Function Name: _mem_buddy_resize
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size
+ * Return Type: alloc_status
+ * Purpose: A buddy block keeps its size as long as the request rounds up
+ * to the same order; any other size has to move.
+ */
+static alloc_status _mem_buddy_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size) {
+    node_pt node = _mem_nodes_live(pool_mgr, alloc);
+    if(node == NULL){
+        return ALLOC_FAIL;
+    }
+    unsigned order = MEM_BUDDY_MIN_ORDER;
+    while(order < MEM_BUDDY_ORDERS && (1ULL << order) < size){
+        ++order;
+    }
+    if(order >= MEM_BUDDY_ORDERS || (1ULL << order) != node->alloc_record.size){
+        return ALLOC_NOT_FREED;
+    }
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_buddy_find_aligned
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size, size_t alignment
+ * Return Type: void *
+ * Purpose: A block lies at a multiple of its size from the pool base, so
+ * a block of at least alignment bytes is aligned if the base is. Halving
+ * it down to the requested order keeps its address.
+ */
+static void *_mem_buddy_find_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment) {
+    if(_mem_align_pad((*pool_mgr).pool.mem, alignment) != 0){
+        return NULL;
+    }
+    return _mem_buddy_find(pool_mgr, (size < alignment) ? alignment : size);
+}
+
+/*
+ * Function Name: _mem_slab_open
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t slot_size
+ * Return Type: alloc_status
+ * Purpose: Sets up the allocation records of a slab pool. The free list
+ * starts out empty and slots are handed out from the never-used tail
+ * (fresh) first, so opening the pool does not touch the pool memory.
+ * All slots together form a single gap.
+ */
+static alloc_status _mem_slab_open(pool_mgr_pt pool_mgr, size_t slot_size) {
+    slab_pt slab = (slab_pt) calloc(1, sizeof(slab_t));
+    if(slab == NULL){
+        return ALLOC_FAIL;
+    }
+    (*pool_mgr).slab = slab;
+    slab->slot_size = slot_size;
+    slab->num_slots = (*pool_mgr).pool.total_size / slot_size;
+    slab->records = (alloc_pt) calloc(slab->num_slots, sizeof(alloc_t));
+    slab->allocated = (unsigned char *) calloc(slab->num_slots, sizeof(unsigned char));
+    if(slab->records == NULL || slab->allocated == NULL){
+        return ALLOC_FAIL;
+    }
+    for(size_t i = 0; i < slab->num_slots; ++i){
+        slab->records[i].size = slot_size;
+        slab->records[i].mem = (*pool_mgr).pool.mem + i * slot_size;
+    }
+    slab->free_head = slab->num_slots;
+    slab->fresh = 0;
+    (*pool_mgr).pool.num_gaps = 1;
+    return ALLOC_OK;
+}
+
+static void _mem_slab_close(pool_mgr_pt pool_mgr) {
+    if ((*pool_mgr).slab != NULL){
+        free((*pool_mgr).slab->records);
+        free((*pool_mgr).slab->allocated);
+        free((*pool_mgr).slab->lf_links);
+        free((*pool_mgr).slab->lf_allocated);
+        free((*pool_mgr).slab);
+        (*pool_mgr).slab = NULL;
+    }
+}
+
+/*
+ * Function Name: _mem_slab_count_gaps
+ * Passed Variables: slab_pt slab, size_t ix, int delta
+ * Return Type: int
+ * Purpose: Returns by how much the number of free runs changes when slot
+ * ix is freed (delta 1) or handed out (delta -1), judging only by its two
+ * neighbours.
+ */
+static int _mem_slab_count_gaps(slab_pt slab, size_t ix, int delta) {
+    int left_free = ix > 0 && !slab->allocated[ix - 1];
+    int right_free = ix + 1 < slab->num_slots && !slab->allocated[ix + 1];
+    if(left_free && right_free){
+        return -delta;  // the slot joins/splits two runs
+    }
+    if(!left_free && !right_free){
+        return delta;   // the slot is a run of its own
+    }
+    return 0;
+}
+
+/*
+ * Function Name: _mem_slab_find
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: void *
+ * Purpose: Returns the record of the most recently freed slot, or of the
+ * next fresh one, or NULL if the slab is full or size does not fit a slot.
+ */
+static void *_mem_slab_find(pool_mgr_pt pool_mgr, size_t size) {
+    slab_pt slab = (*pool_mgr).slab;
+    if(size > slab->slot_size){
+        return NULL;
+    }
+    if(slab->free_head != slab->num_slots){
+        return &slab->records[slab->free_head];
+    }
+    if(slab->fresh < slab->num_slots){
+        return &slab->records[slab->fresh];
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_slab_split
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block, size_t size
+ * Return Type: alloc_pt
+ * Purpose: Hands out the slot found by _mem_slab_find, popping it off the
+ * free list or the fresh tail. The link to the next free slot is stored
+ * in the slot itself.
+ */
+static alloc_pt _mem_slab_split(pool_mgr_pt pool_mgr, void *block, size_t size) {
+    slab_pt slab = (*pool_mgr).slab;
+    size_t ix = (size_t) ((alloc_pt) block - slab->records);
+    (void) size;
+    if(ix == slab->free_head){
+        memcpy(&slab->free_head, slab->records[ix].mem, sizeof(size_t));
+    }
+    else{
+        slab->fresh++;
+    }
+    slab->allocated[ix] = 1;
+    (*pool_mgr).pool.num_gaps += _mem_slab_count_gaps(slab, ix, -1);
+    (*pool_mgr).pool.num_allocs++;
+    (*pool_mgr).pool.alloc_size += slab->slot_size;
+    return &slab->records[ix];
+}
+
+/*
+ * Function Name: _mem_slab_release
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: void *
+ * Purpose: Marks a slot free again. The record is resolved by its
+ * position in the record array, so foreign or already freed records are
+ * rejected with NULL in O(1).
+ */
+static void *_mem_slab_release(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    slab_pt slab = (*pool_mgr).slab;
+    size_t ix = _mem_slab_ix(slab, alloc);
+    if(ix == slab->num_slots || !slab->allocated[ix]){
+        return NULL;
+    }
+    slab->allocated[ix] = 0;
+    (*pool_mgr).pool.num_allocs--;
+    (*pool_mgr).pool.alloc_size -= slab->slot_size;
+    return &slab->records[ix];
+}
+
+/*
+ * Function Name: _mem_slab_coalesce
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block
+ * Return Type: alloc_status
+ * Purpose: Pushes a released slot on the free list. Slots never merge,
+ * only the count of free runs changes.
+ */
+static alloc_status _mem_slab_coalesce(pool_mgr_pt pool_mgr, void *block) {
+    slab_pt slab = (*pool_mgr).slab;
+    size_t ix = (size_t) ((alloc_pt) block - slab->records);
+    memcpy(slab->records[ix].mem, &slab->free_head, sizeof(size_t));
+    slab->free_head = ix;
+    (*pool_mgr).pool.num_gaps += _mem_slab_count_gaps(slab, ix, 1);
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_slab_inspect
+ * Passed Variables: pool_mgr_pt pool_mgr, pool_segment_pt segs
+ * Return Type: unsigned
+ * Purpose: Fills in one segment per allocated slot and one per run of
+ * free slots, num_allocs + num_gaps segments in total.
+ */
+static unsigned _mem_slab_inspect(pool_mgr_pt pool_mgr, pool_segment_pt segs) {
+    slab_pt slab = (*pool_mgr).slab;
+    unsigned seg = 0;
+    if(segs == NULL){
+        return (*pool_mgr).pool.num_allocs + (*pool_mgr).pool.num_gaps;
+    }
+    for(size_t i = 0; i < slab->num_slots; ++i){
+        if(slab->allocated[i]){
+            segs[seg].size = slab->slot_size;
+            segs[seg++].allocated = 1;
+        }
+        else if(i > 0 && !slab->allocated[i - 1]){
+            segs[seg - 1].size += slab->slot_size;
+        }
+        else{
+            segs[seg].size = slab->slot_size;
+            segs[seg++].allocated = 0;
+        }
+    }
+    return seg;
+}
+
+/*
+ * Function Name: _mem_slab_ix
+ * Passed Variables: slab_pt slab, alloc_pt alloc
+ * Return Type: size_t
+ * Purpose: Resolves a record by its position in the record array, so
+ * foreign records are found in O(1). Returns num_slots for those.
+ */
+static size_t _mem_slab_ix(slab_pt slab, alloc_pt alloc) {
+    uintptr_t first = (uintptr_t) slab->records;
+    uintptr_t addr = (uintptr_t) alloc;
+    if(addr < first || addr >= first + slab->num_slots * sizeof(alloc_t) ||
+       (addr - first) % sizeof(alloc_t) != 0){
+        return slab->num_slots;
+    }
+    return (addr - first) / sizeof(alloc_t);
+}
+
+/*
+ * Function Name: _mem_slab_resize
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size
+ * Return Type: alloc_status
+ * Purpose: A slot holds any size up to the slot size and nothing more.
+ */
+static alloc_status _mem_slab_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size) {
+    slab_pt slab = (*pool_mgr).slab;
+    size_t ix = _mem_slab_ix(slab, alloc);
+    if(ix == slab->num_slots || !slab->allocated[ix]){
+        return ALLOC_FAIL;
+    }
+    return (size <= slab->slot_size) ? ALLOC_OK : ALLOC_NOT_FREED;
+}
+
+/*
+ * Function Name: _mem_slab_find_aligned
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size, size_t alignment
+ * Return Type: void *
+ * Purpose: Every slot is aligned if the base is and the slot size is a
+ * multiple of alignment, and none is guaranteed to be otherwise.
+ */
+static void *_mem_slab_find_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment) {
+    if(_mem_align_pad((*pool_mgr).pool.mem, alignment) != 0 ||
+       (*pool_mgr).slab->slot_size % alignment != 0){
+        return NULL;
+    }
+    return pool_mgr->policy->find(pool_mgr, size);
+}
+
+/*
+ * Function Name: _mem_slab_lf_open
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t slot_size
+ * Return Type: alloc_status
+ * Purpose: Sets up a lock-free slab pool. The links of the free list live
+ * in an array of their own rather than in the slots, so a thread that
+ * loses a race never reads a slot another thread already handed out.
+ * All slots start out on the free list, lowest first. Slots are not
+ * merged, every free slot counts as a gap of its own.
+ */
+static alloc_status _mem_slab_lf_open(pool_mgr_pt pool_mgr, size_t slot_size) {
+    if(_mem_slab_open(pool_mgr, slot_size) != ALLOC_OK){
+        return ALLOC_FAIL;
+    }
+    slab_pt slab = (*pool_mgr).slab;
+    free(slab->allocated);
+    slab->allocated = NULL;
+    slab->lf_links = calloc(slab->num_slots, sizeof(*slab->lf_links));
+    slab->lf_allocated = calloc(slab->num_slots, sizeof(*slab->lf_allocated));
+    if(slab->lf_links == NULL || slab->lf_allocated == NULL){
+        return ALLOC_FAIL;
+    }
+    for(size_t i = 0; i < slab->num_slots; ++i){
+        atomic_init(&slab->lf_links[i], (uint32_t) (i + 1));
+        atomic_init(&slab->lf_allocated[i], 0);
+    }
+    atomic_init(&slab->lf_head, 0);
+    (*pool_mgr).pool.num_gaps = (unsigned) slab->num_slots;
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_slab_lf_find
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size
+ * Return Type: void *
+ * Purpose: Pops the first free slot off the lock-free stack and returns
+ * its record, or NULL if the slab is full or size does not fit a slot.
+ * The head carries a tag that every pop and push increments, so a head
+ * that was popped and pushed again in the meantime fails the swap (ABA).
+ */
+static void *_mem_slab_lf_find(pool_mgr_pt pool_mgr, size_t size) {
+    slab_pt slab = (*pool_mgr).slab;
+    if(size > slab->slot_size){
+        return NULL;
+    }
+    uint64_t head = atomic_load_explicit(&slab->lf_head, memory_order_acquire);
+    uint64_t next;
+    do {
+        uint32_t ix = (uint32_t) head;
+        if(ix >= slab->num_slots){
+            return NULL;
+        }
+        next = ((head >> 32) + 1) << 32 |
+               atomic_load_explicit(&slab->lf_links[ix], memory_order_relaxed);
+    } while(!atomic_compare_exchange_weak_explicit(&slab->lf_head, &head, next,
+                                                   memory_order_acquire, memory_order_acquire));
+    return &slab->records[(uint32_t) head];
+}
+
+/*
+ * Function Name: _mem_slab_lf_split
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block, size_t size
+ * Return Type: alloc_pt
+ * Purpose: Marks a popped slot handed out. The pool metadata is updated
+ * with atomic adds.
+ */
+static alloc_pt _mem_slab_lf_split(pool_mgr_pt pool_mgr, void *block, size_t size) {
+    slab_pt slab = (*pool_mgr).slab;
+    size_t ix = (size_t) ((alloc_pt) block - slab->records);
+    (void) size;
+    atomic_store_explicit(&slab->lf_allocated[ix], 1, memory_order_relaxed);
+    __atomic_fetch_sub(&(*pool_mgr).pool.num_gaps, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(*pool_mgr).pool.num_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(*pool_mgr).pool.alloc_size, slab->slot_size, __ATOMIC_RELAXED);
+    return &slab->records[ix];
+}
+
+/*
+ * Function Name: _mem_slab_lf_release
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: void *
+ * Purpose: Like _mem_slab_release. Clearing the allocated flag is an
+ * atomic exchange, so of two threads freeing the same slot only one wins.
+ */
+static void *_mem_slab_lf_release(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    slab_pt slab = (*pool_mgr).slab;
+    size_t ix = _mem_slab_ix(slab, alloc);
+    if(ix == slab->num_slots){
+        return NULL;
+    }
+    if(atomic_exchange_explicit(&slab->lf_allocated[ix], 0, memory_order_relaxed) == 0){
+        return NULL;
+    }
+    __atomic_fetch_sub(&(*pool_mgr).pool.num_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&(*pool_mgr).pool.alloc_size, slab->slot_size, __ATOMIC_RELAXED);
+    return &slab->records[ix];
+}
+
+/*
+ * Function Name: _mem_slab_lf_coalesce
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block
+ * Return Type: alloc_status
+ * Purpose: Pushes a released slot on the lock-free stack.
+ */
+static alloc_status _mem_slab_lf_coalesce(pool_mgr_pt pool_mgr, void *block) {
+    slab_pt slab = (*pool_mgr).slab;
+    uint32_t ix = (uint32_t) ((alloc_pt) block - slab->records);
+    uint64_t head = atomic_load_explicit(&slab->lf_head, memory_order_relaxed);
+    uint64_t next;
+    do {
+        atomic_store_explicit(&slab->lf_links[ix], (uint32_t) head, memory_order_relaxed);
+        next = ((head >> 32) + 1) << 32 | ix;
+    } while(!atomic_compare_exchange_weak_explicit(&slab->lf_head, &head, next,
+                                                   memory_order_release, memory_order_relaxed));
+    __atomic_fetch_add(&(*pool_mgr).pool.num_gaps, 1, __ATOMIC_RELAXED);
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_slab_lf_inspect
+ * Passed Variables: pool_mgr_pt pool_mgr, pool_segment_pt segs
+ * Return Type: unsigned
+ * Purpose: Fills in one segment per slot. Slots that are handed out or
+ * freed meanwhile may show either way.
+ */
+static unsigned _mem_slab_lf_inspect(pool_mgr_pt pool_mgr, pool_segment_pt segs) {
+    slab_pt slab = (*pool_mgr).slab;
+    if(segs != NULL){
+        for(size_t i = 0; i < slab->num_slots; ++i){
+            segs[i].size = slab->slot_size;
+            segs[i].allocated = atomic_load_explicit(&slab->lf_allocated[i], memory_order_relaxed);
+        }
+    }
+    return (unsigned) slab->num_slots;
+}
+
+static alloc_status _mem_slab_lf_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size) {
+    slab_pt slab = (*pool_mgr).slab;
+    size_t ix = _mem_slab_ix(slab, alloc);
+    if(ix == slab->num_slots || !atomic_load_explicit(&slab->lf_allocated[ix], memory_order_relaxed)){
+        return ALLOC_FAIL;
+    }
+    return (size <= slab->slot_size) ? ALLOC_OK : ALLOC_NOT_FREED;
+}
+
+/*
+ * Function Name: _mem_shards_open
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t num_shards
+ * Return Type: alloc_status
+ * Purpose: Splits the pool memory into num_shards POOL_THREAD_SAFE pools
+ * of the pool's policy, all but the last of equal size. The metadata of
+ * the sharded pool is the sum of that of its shards.
+ */
+static alloc_status _mem_shards_open(pool_mgr_pt pool_mgr, size_t num_shards) {
+    (*pool_mgr).shards = (pool_mgr_pt *) calloc(num_shards, sizeof(pool_mgr_pt));
+    if((*pool_mgr).shards == NULL){
+        return ALLOC_FAIL;
+    }
+    (*pool_mgr).shard_size = (*pool_mgr).pool.total_size / num_shards;
+    for(unsigned i = 0; i < num_shards; ++i){
+        size_t offset = i * (*pool_mgr).shard_size;
+        size_t size = (i + 1 < num_shards) ? (*pool_mgr).shard_size : (*pool_mgr).pool.total_size - offset;
+        pool_mgr_pt shard = _mem_pool_create(size, (*pool_mgr).pool.policy, 0, POOL_THREAD_SAFE,
+                                             pool_mgr, (*pool_mgr).pool.mem + offset);
+        if(shard == NULL){
+            return ALLOC_FAIL;
+        }
+        (*pool_mgr).shards[(*pool_mgr).num_shards++] = shard;
+        (*pool_mgr).pool.num_gaps += shard->pool.num_gaps;
+    }
+    return ALLOC_OK;
+}
+
+static void _mem_shards_close(pool_mgr_pt pool_mgr) {
+    for(unsigned i = 0; i < (*pool_mgr).num_shards; ++i){
+        _mem_pool_destroy((*pool_mgr).shards[i]);
+    }
+    free((*pool_mgr).shards);
+}
+
+/*
+ * Function Name: _mem_shards_alloc
+ * Passed Variables: pool_mgr_pt pool_mgr, pool_mgr_pt shard, size_t size, size_t alignment
+ * Return Type: alloc_pt
+ * Purpose: Allocates from one shard under its lock and carries the change
+ * in its number of gaps over to the sharded pool. An alignment of 1
+ * takes any block.
+ */
+static alloc_pt _mem_shards_alloc(pool_mgr_pt pool_mgr, pool_mgr_pt shard, size_t size, size_t alignment) {
+    alloc_pt alloc = NULL;
+    _mem_pool_lock(shard);
+    unsigned num_gaps = shard->pool.num_gaps;
+    if(num_gaps != 0){
+        void *block = (alignment == 1) ? shard->policy->find(shard, size)
+                                       : shard->policy->find_aligned(shard, size, alignment);
+        if(block != NULL){
+            alloc = shard->policy->split(shard, block, size);
+        }
+    }
+    __atomic_fetch_add(&(*pool_mgr).pool.num_gaps, shard->pool.num_gaps - num_gaps, __ATOMIC_RELAXED);
+    _mem_pool_unlock(shard);
+    return alloc;
+}
+
+/*
+ * Function Name: _mem_shards_find, _mem_shards_find_aligned
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size(, size_t alignment)
+ * Return Type: void *
+ * Purpose: Allocates from the calling thread's home shard, or steals from
+ * the following shards in turn if it cannot serve the request. Threads
+ * get their home shards round robin, in the order they first allocate.
+ * A request that no shard can serve on its own is tried once more on
+ * the free memory that runs across shard borders.
+ */
+static void *_mem_shards_find(pool_mgr_pt pool_mgr, size_t size) {
+    return _mem_shards_find_aligned(pool_mgr, size, 1);
+}
+
+static void *_mem_shards_find_aligned(pool_mgr_pt pool_mgr, size_t size, size_t alignment) {
+    if(thread_ticket == 0){
+        thread_ticket = atomic_fetch_add_explicit(&thread_tickets, 1, memory_order_relaxed) + 1;
+    }
+    unsigned home = (thread_ticket - 1) % (*pool_mgr).num_shards;
+    for(unsigned i = 0; i < (*pool_mgr).num_shards; ++i){
+        pool_mgr_pt shard = (*pool_mgr).shards[(home + i) % (*pool_mgr).num_shards];
+        alloc_pt alloc = _mem_shards_alloc(pool_mgr, shard, size, alignment);
+        if(alloc != NULL){
+            return alloc;
+        }
+    }
+    _mem_shards_lock_all(pool_mgr);
+    alloc_pt alloc = _mem_shards_join(pool_mgr, size, alignment);
+    _mem_shards_unlock_all(pool_mgr);
+    return alloc;
+}
+
+/*
+ * Function Name: _mem_shards_join
+ * Passed Variables: pool_mgr_pt pool_mgr, size_t size, size_t alignment
+ * Return Type: alloc_pt
+ * Purpose: Looks for free memory that runs across shard borders: the gap
+ * at the end of one shard, any shards after it that are all free, and
+ * the gap at the start of the next. If it holds the request, the part of
+ * it that is needed moves into the first of those shards, where it
+ * merges with the gap at its end and the request is served. Returns
+ * NULL otherwise. The caller holds the locks of all shards. BUDDY shards
+ * never hand memory on, their blocks must stay aligned to their size.
+ */
+static alloc_pt _mem_shards_join(pool_mgr_pt pool_mgr, size_t size, size_t alignment) {
+    if((*pool_mgr).pool.policy == BUDDY || size > (*pool_mgr).pool.total_size){
+        return NULL;
+    }
+    unsigned first = 0;
+    node_pt run = NULL; // the gap at the end of shards[first] the free memory starts with
+    size_t run_size = 0;
+    for(unsigned i = 0; i < (*pool_mgr).num_shards; ++i){
+        pool_mgr_pt shard = (*pool_mgr).shards[i];
+        if(shard->head == NULL){
+            // a shard with no memory left, the run goes on behind it
+            continue;
+        }
+        if(run != NULL && shard->head->allocated == 0){
+            size_t need = _mem_align_pad(run->alloc_record.mem, alignment) + size;
+            if(run_size + shard->head->alloc_record.size >= need){
+                unsigned num_gaps = 0;
+                for(unsigned j = first; j <= i; ++j){
+                    num_gaps += (*pool_mgr).shards[j]->pool.num_gaps;
+                }
+                pool_mgr_pt to = (*pool_mgr).shards[first];
+                _mem_shards_move(pool_mgr, first, i, (need > run_size) ? need - run_size : 0);
+                void *block = (alignment == 1) ? (void *) run : _mem_nodes_align_gap(to, run, alignment);
+                alloc_pt alloc = (block != NULL) ? to->policy->split(to, block, size) : NULL;
+                for(unsigned j = first; j <= i; ++j){
+                    num_gaps -= (*pool_mgr).shards[j]->pool.num_gaps;
+                }
+                __atomic_fetch_sub(&(*pool_mgr).pool.num_gaps, num_gaps, __ATOMIC_RELAXED);
+                return alloc;
+            }
+            if(shard->head->next == NULL){
+                // all free, the run goes on through it
+                run_size += shard->head->alloc_record.size;
+                continue;
+            }
+        }
+        first = i;
+        run = (shard->tail->allocated == 0) ? shard->tail : NULL;
+        run_size = (run != NULL) ? run->alloc_record.size : 0;
+    }
+    return NULL;
+}
+
+/*
+ * Function Name: _mem_shards_move
+ * Passed Variables: pool_mgr_pt pool_mgr, unsigned first, unsigned last, size_t size
+ * Return Type: void
+ * Purpose: Moves the shards after first up to last, all of them free,
+ * and size bytes off the front of the gap that last starts with, onto
+ * the end of the gap shards[first] ends with, and moves the starts of
+ * the shards after first up behind it. Only free memory changes shards,
+ * so no allocation ever leaves the shard its address falls in, and
+ * _mem_shards_of can read the starts without a lock. The caller holds
+ * the locks of all shards.
+ */
+static void _mem_shards_move(pool_mgr_pt pool_mgr, unsigned first, unsigned last, size_t size) {
+    pool_mgr_pt to = (*pool_mgr).shards[first];
+    node_pt gap = to->tail;
+    size_t moved = 0;
+    for(unsigned i = first + 1; i <= last; ++i){
+        pool_mgr_pt from = (*pool_mgr).shards[i];
+        node_pt head = from->head;
+        size_t part = (head == NULL) ? 0 : (i < last) ? head->alloc_record.size : size;
+        if(part == 0){
+            continue;
+        }
+        _mem_remove_from_gap_ix(from, 0, head);
+        if(part == head->alloc_record.size){
+            from->head = head->next;
+            if(head->next != NULL){
+                head->next->prev = NULL;
+            }
+            _mem_release_node(from, head);
+        }
+        else{
+            head->alloc_record.mem += part;
+            _mem_add_to_gap_ix(from, head->alloc_record.size - part, head);
+        }
+        from->pool.total_size -= part;
+        moved += part;
+    }
+    char *border = gap->alloc_record.mem + gap->alloc_record.size + moved;
+    for(unsigned i = first + 1; i <= last; ++i){
+        __atomic_store_n(&(*pool_mgr).shards[i]->pool.mem, border, __ATOMIC_RELEASE);
+    }
+    _mem_remove_from_gap_ix(to, 0, gap);
+    _mem_add_to_gap_ix(to, gap->alloc_record.size + moved, gap);
+    to->pool.total_size += moved;
+}
+
+/*
+ * Function Name: _mem_shards_split
+ * Passed Variables: pool_mgr_pt pool_mgr, void *block, size_t size
+ * Return Type: alloc_pt
+ * Purpose: The shard already carved the allocation, only the metadata of
+ * the sharded pool is left to update.
+ */
+static alloc_pt _mem_shards_split(pool_mgr_pt pool_mgr, void *block, size_t size) {
+    alloc_pt alloc = (alloc_pt) block;
+    (void) size;
+    __atomic_fetch_add(&(*pool_mgr).pool.num_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(*pool_mgr).pool.alloc_size, alloc->size, __ATOMIC_RELAXED);
+    return alloc;
+}
+
+/*
+ * Function Name: _mem_shards_release
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: void *
+ * Purpose: Frees an allocation into the shard its address falls in, and
+ * coalesces it there under the shard's lock.
+ */
+static void *_mem_shards_release(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    pool_mgr_pt shard = _mem_shards_of(pool_mgr, alloc);
+    if(shard == NULL){
+        return NULL;
+    }
+    size_t size = alloc->size;
+    _mem_pool_lock(shard);
+    unsigned num_gaps = shard->pool.num_gaps;
+    void *block = shard->policy->release(shard, alloc);
+    if(block != NULL){
+        shard->policy->coalesce(shard, block);
+        __atomic_fetch_add(&(*pool_mgr).pool.num_gaps, shard->pool.num_gaps - num_gaps, __ATOMIC_RELAXED);
+    }
+    _mem_pool_unlock(shard);
+    if(block == NULL){
+        return NULL;
+    }
+    __atomic_fetch_sub(&(*pool_mgr).pool.num_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&(*pool_mgr).pool.alloc_size, size, __ATOMIC_RELAXED);
+    return alloc;
+}
+
+static alloc_status _mem_shards_coalesce(pool_mgr_pt pool_mgr, void *block) {
+    (void) pool_mgr;
+    (void) block;
+    return ALLOC_OK;
+}
+
+/*
+ * Function Name: _mem_shards_inspect
+ * Passed Variables: pool_mgr_pt pool_mgr, pool_segment_pt segs
+ * Return Type: unsigned
+ * Purpose: Lists the segments of all shards in address order. Gaps at
+ * the end of one shard and the start of the next stay apart. The caller
+ * holds the locks of all shards.
+ */
+static unsigned _mem_shards_inspect(pool_mgr_pt pool_mgr, pool_segment_pt segs) {
+    unsigned num = 0;
+    for(unsigned i = 0; i < (*pool_mgr).num_shards; ++i){
+        pool_mgr_pt shard = (*pool_mgr).shards[i];
+        num += shard->policy->inspect(shard, (segs != NULL) ? segs + num : NULL);
+    }
+    return num;
+}
+
+/*
+ * Function Name: _mem_shards_lock_all, _mem_shards_unlock_all
+ * Passed Variables: pool_mgr_pt pool_mgr
+ * Return Type: void
+ * Purpose: Takes the locks of all shards, always in index order so that
+ * two threads doing so cannot deadlock, and gives them back.
+ */
+static void _mem_shards_lock_all(pool_mgr_pt pool_mgr) {
+    for(unsigned i = 0; i < (*pool_mgr).num_shards; ++i){
+        _mem_pool_lock((*pool_mgr).shards[i]);
+    }
+}
+
+static void _mem_shards_unlock_all(pool_mgr_pt pool_mgr) {
+    for(unsigned i = (*pool_mgr).num_shards; i > 0; --i){
+        _mem_pool_unlock((*pool_mgr).shards[i - 1]);
+    }
+}
+
+/*
+ * Function Name: _mem_shards_of
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc
+ * Return Type: pool_mgr_pt
+ * Purpose: The shard whose memory alloc points into, NULL if none.
+ */
+static pool_mgr_pt _mem_shards_of(pool_mgr_pt pool_mgr, alloc_pt alloc) {
+    if(alloc == NULL || alloc->mem < (*pool_mgr).pool.mem ||
+       alloc->mem >= (*pool_mgr).pool.mem + (*pool_mgr).pool.total_size){
+        return NULL;
+    }
+    // the last shard that starts at or before alloc->mem; shards that gave
+    // all their memory away start where the next one does
+    unsigned lo = 0, hi = (*pool_mgr).num_shards;
+    while(hi - lo > 1){
+        unsigned mid = lo + (hi - lo) / 2;
+        if(__atomic_load_n(&(*pool_mgr).shards[mid]->pool.mem, __ATOMIC_ACQUIRE) <= alloc->mem){
+            lo = mid;
+        }
+        else{
+            hi = mid;
+        }
+    }
+    return (*pool_mgr).shards[lo];
+}
+
+/*
+ * Function Name: _mem_shards_resize
+ * Passed Variables: pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size
+ * Return Type: alloc_status
+ * Purpose: Resizes an allocation in place within its shard, which never
+ * reaches into the next shard.
+ */
+static alloc_status _mem_shards_resize(pool_mgr_pt pool_mgr, alloc_pt alloc, size_t size) {
+    pool_mgr_pt shard = _mem_shards_of(pool_mgr, alloc);
+    if(shard == NULL){
+        return ALLOC_FAIL;
+    }
+    _mem_pool_lock(shard);
+    unsigned num_gaps = shard->pool.num_gaps;
+    size_t alloc_size = shard->pool.alloc_size;
+    alloc_status status = shard->policy->resize(shard, alloc, size);
+    __atomic_fetch_add(&(*pool_mgr).pool.num_gaps, shard->pool.num_gaps - num_gaps, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&(*pool_mgr).pool.alloc_size, shard->pool.alloc_size - alloc_size, __ATOMIC_RELAXED);
+    _mem_pool_unlock(shard);
+    return status;
+}
@@ -9,7 +9,35 @@
 
 /* type declarations */
 
-typedef enum _alloc_policy { FIRST_FIT, BEST_FIT } alloc_policy;
+// note: BUDDY rounds every allocation up to a power of two, which is
+// the size reported in the allocation record and in the pool metadata
+// note: SLAB pools are opened with mem_pool_open_slab(_flags) only; in a
+// POOL_THREAD_SAFE slab pool every free slot counts as a gap of its own
+typedef enum _alloc_policy { FIRST_FIT, BEST_FIT, TLSF, BUDDY, SLAB, NEXT_FIT } alloc_policy;
+
+// flags of mem_pool_open_flags
+#define POOL_THREAD_SAFE 0x1u // the pool may be shared between threads
+#define POOL_THREAD_CACHE 0x2u // POOL_THREAD_SAFE with a cache of freed blocks per thread
+#define POOL_OWNED 0x4u // only the opening thread allocates, any thread may free
+#define POOL_HUGE_PAGES 0x8u // the pool is mapped on 2 MiB aligned huge pages
+#define POOL_RESERVE 0x10u // the pool is reserved up front and committed as it fills up
+#define POOL_GROWABLE 0x20u // the pool adds regions of memory instead of running out
+// note: in a POOL_THREAD_CACHE pool, requests of up to 1024 bytes are rounded
+// up to a multiple of 16, and freed blocks still count as allocations
+// while they sit in a thread cache
+// note: in a POOL_OWNED pool, blocks freed by other threads count as
+// allocations until the owner's next mem_new_alloc
+// note: a pool from mem_pool_open_sharded is thread safe; its metadata is
+// the sum over its shards, and gaps only merge across two shards when a
+// request needs them to (never for BUDDY)
+// note: mem is the first region of a POOL_GROWABLE pool and total_size
+// covers all of them; gaps never span two regions
+// note: a pool from mem_pool_open_file is a snapshot at sync, not a
+// persistent heap: its memory lives in the file, but its segments are
+// only saved by mem_pool_sync and mem_pool_close, and reopening rebuilds
+// them from that snapshot; allocations made after it are lost in a crash.
+// Allocations are found again from their offsets, since records and
+// addresses do not persist
 
 typedef struct _pool {
     char *mem;
@@ -18,6 +46,8 @@ typedef struct _pool {
     size_t alloc_size;
     unsigned num_allocs;
     unsigned num_gaps;
+    size_t committed_size; // backed by memory, from mem on; total_size unless POOL_RESERVE
+    size_t purged_size; // free, given back to the system (see mem_pool_set_decay)
 } pool_t, *pool_pt;
 
 typedef struct _alloc {
@@ -48,16 +78,61 @@ mem_free();
 pool_pt
 mem_pool_open(size_t size, alloc_policy policy);
 
+pool_pt
+mem_pool_open_flags(size_t size, alloc_policy policy, unsigned flags);
+
+pool_pt
+mem_pool_open_sharded(size_t size, alloc_policy policy, unsigned num_shards);
+
+pool_pt
+mem_pool_open_slab(size_t obj_size, size_t count);
+
+pool_pt
+mem_pool_open_slab_flags(size_t obj_size, size_t count, unsigned flags);
+
+pool_pt
+mem_pool_open_file(const char *path, size_t size, alloc_policy policy);
+
+alloc_status
+mem_pool_set_max_size(pool_pt pool, size_t max_size);
+
+alloc_status
+mem_pool_set_decay(pool_pt pool, long decay_ms);
+
+alloc_status
+mem_pool_purge(pool_pt pool);
+
+alloc_status
+mem_pool_sync(pool_pt pool);
+
 alloc_status
 mem_pool_close(pool_pt pool);
 
 alloc_pt
 mem_new_alloc(pool_pt pool, size_t size);
 
+alloc_pt
+mem_new_alloc_aligned(pool_pt pool, size_t size, size_t alignment);
+
+alloc_status
+mem_new_alloc_batch(pool_pt pool, const size_t *sizes, alloc_pt *allocs, unsigned num);
+
+alloc_pt
+mem_realloc_alloc(pool_pt pool, alloc_pt alloc, size_t size);
+
 alloc_status
 mem_del_alloc(pool_pt pool, alloc_pt alloc);
 
+alloc_status
+mem_del_alloc_batch(pool_pt pool, alloc_pt *allocs, unsigned num);
+
 void
 mem_inspect_pool(pool_pt pool, pool_segment_pt *segments, unsigned *num_segments);
 
+size_t
+mem_alloc_offset(pool_pt pool, alloc_pt alloc);
+
+alloc_pt
+mem_alloc_at(pool_pt pool, size_t offset);
+
 #endif //DENVER_OS_PA_C_MEM_POOL_H
@@ -2,8 +2,20 @@
 // Created by Ivo Georgiev on 3/3/16.
 //
 
+#define _POSIX_C_SOURCE 200809L // clock_gettime()
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h> // close(), unlink(), fork()
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <stdarg.h>
 #include <stddef.h>
@@ -216,6 +228,7 @@ static void test_pool_nonempty(void **state) {
     assert_non_null(alloc);
     assert_non_null(alloc->mem);
     assert_in_range(alloc->size, 100, 100);
+    assert_ptr_equal(alloc->mem, pool->mem); // carved out of the pool itself
 
     INFO("Trying to close pool...");
     status = mem_pool_close(pool);
@@ -235,6 +248,64 @@ static void test_pool_nonempty(void **state) {
 }
 
 
+static void test_pool_foreign_alloc(void **state) {
+    (void) state; /* unused */
+
+    alloc_status status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    pool_pt pool0 = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool0);
+    pool_pt pool1 = mem_pool_open(POOL_SIZE, BEST_FIT);
+    assert_non_null(pool1);
+
+    alloc_pt alloc0 = mem_new_alloc(pool0, 100);
+    assert_non_null(alloc0);
+    alloc_pt alloc1 = mem_new_alloc(pool1, 100);
+    assert_non_null(alloc1);
+    alloc_pt alloc2 = mem_new_alloc(pool1, 100);
+    assert_non_null(alloc2);
+
+    INFO("Deallocating from the wrong pool\n");
+    assert_int_equal(mem_del_alloc(pool0, alloc2), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(pool1, alloc0), ALLOC_FAIL);
+
+    INFO("Deallocating twice\n");
+    assert_int_equal(mem_del_alloc(pool1, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool1, alloc1), ALLOC_FAIL);
+
+    assert_int_equal(mem_del_alloc(pool1, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool0, alloc0), ALLOC_OK);
+
+    assert_int_equal(mem_pool_close(pool1), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool0), ALLOC_OK);
+
+    status = mem_free();
+    assert_int_equal(status, ALLOC_OK);
+}
+
+static void test_pool_store_close_then_free(void **state) {
+    (void) state; /* unused */
+
+    alloc_status status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    pool_pt pool0 = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(pool0);
+    pool_pt pool1 = mem_pool_open_flags(POOL_SIZE, BEST_FIT, POOL_THREAD_SAFE);
+    assert_non_null(pool1);
+    pool_pt pool2 = mem_pool_open(POOL_SIZE, TLSF);
+    assert_non_null(pool2);
+
+    INFO("Closing a pool takes it out of the store\n");
+    assert_int_equal(mem_pool_close(pool0), ALLOC_OK);
+
+    INFO("mem_free closes the pools left open\n");
+    status = mem_free();
+    assert_int_equal(status, ALLOC_OK);
+}
+
+
 /*******************************************/
 /***       2. USER-FACING METADATA       ***/
 /*******************************************/
@@ -279,6 +350,7 @@ static void test_pool_ff_metadata(void **state) {
     // 3. allocate 1000
     alloc_pt alloc1 = mem_new_alloc(pool, 1000);
     assert_non_null(alloc1);
+    assert_ptr_equal(alloc1->mem, alloc0->mem + 100);
 
     pool_segment_t exp2[3] =
             {
@@ -2316,99 +2388,1854 @@ static void test_pool_scenario19(void **state) {
 }
 
 /*******************************************/
-/***          5. STRESS TEST             ***/
-/***                                     ***/
-/***         [non-functional]            ***/
-/***         [see NOTE below]            ***/
+/***         5. OTHER POLICIES           ***/
 /*******************************************/
 
-void test_pool_stresstest(void **state) {
-    (void) state; /* unused */
+static int pool_nf_setup(void **state) {
+    alloc_status status;
+    pool_pt pool = NULL;
 
-    const unsigned num_pools = 200;
-    const unsigned num_allocations = 1000;
-    const unsigned min_alloc_size = 10;
-    const unsigned pool_size =
-            (num_allocations / 2) *
-            (2 * min_alloc_size + (num_allocations - 1) * min_alloc_size);
-    assert_int_equal(pool_size, 5005000);
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
 
+    INFO("Allocating pool of %lu bytes with policy NEXT_FIT\n", (long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, NEXT_FIT);
+    assert_non_null(pool);
 
-    pool_pt pools[num_pools];
-    alloc_pt allocations[num_pools][num_allocations];
+    *state = pool;
+
+    return 0;
+}
+
+static void test_pool_nf_scenario(void **state) {
+    alloc_status status;
+    pool_pt pool = *state;
 
     /*
-     * NOTE: This will work iff the address of the allocation
-     * in the pool is returned to the user instead of the
-     * address of the allocation record. Since allocation records
-     * are a part of the nodes, when the node heap is reallocated
-     * the node addresses shift with it, and so do the allocation
-     * record addresses. The allocation addresses on the pool
-     * remain the same, however, so they can be returned to the
-     * user and gotten from the user upon request for deletion.
+     * NEXT_FIT scenario:
+     *
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 3 x 100.
+     * 3. Deallocate the first 100.
+     * 4. Allocate 50. The search resumes after the last
+     *    allocation, so the hole at the top is skipped.
+     * 5. Allocate the rest of the pool.
+     * 6. Allocate 50. The search wraps around to the hole.
+     * 7. Clean up.
      */
 
+    pool_segment_t exp0[1] =
+            {
+                    {pool->total_size, 0}
+            };
+    check_pool(pool, exp0);
+
+
+    alloc_pt allocs[3];
+    for (unsigned i = 0; i < 3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+    status = mem_del_alloc(pool, allocs[0]);
+    assert_int_equal(status, ALLOC_OK);
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 50);
+    assert_non_null(alloc0);
+
+    pool_segment_t exp1[5] =
+            {
+                    {100, 0},
+                    {100, 1},
+                    {100, 1},
+                    {50, 1},
+                    {pool->total_size - 350, 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, NEXT_FIT, POOL_SIZE, 250, 3, 2);
+
+
+    alloc_pt alloc1 = mem_new_alloc(pool, pool->total_size - 350);
+    assert_non_null(alloc1);
+    alloc_pt alloc2 = mem_new_alloc(pool, 50);
+    assert_non_null(alloc2);
+
+    pool_segment_t exp2[6] =
+            {
+                    {50, 1},
+                    {50, 0},
+                    {100, 1},
+                    {100, 1},
+                    {50, 1},
+                    {pool->total_size - 350, 1}
+            };
+    check_pool(pool, exp2);
+    check_metadata(pool, NEXT_FIT, POOL_SIZE, pool->total_size - 50, 5, 1);
+
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+
+    check_pool(pool, exp0);
+    check_metadata(pool, NEXT_FIT, POOL_SIZE, 0, 0, 1);
+}
+
+static int pool_tlsf_setup(void **state) {
+    alloc_status status;
+    pool_pt pool = NULL;
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes with policy TLSF\n", (long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, TLSF);
+    assert_non_null(pool);
+
+    *state = pool;
+
+    return 0;
+}
+
+static void test_pool_tlsf_scenario(void **state) {
+    alloc_status status;
+    pool_pt pool = *state;
+
     /*
-     * Testing dynamic reallocation of pool structures:
+     * TLSF scenario:
      *
-     * 1. 200 pools of 5005000 each (many pools)
-     * 2. In each pool 1000 allocations of different sizes (many allocations)
-     * 3. In each pool 500 deallocations (many gaps)
+     * 1. Pool starts out as a single gap.
+     * 2. Allocate 100, 1000, 10000.
+     * 3. Deallocate the 1000.
+     * 4. Allocate 500. It is served from the 1000 gap, the
+     *    only one in a size class that is large enough.
+     * 5. Deallocate the 100.
+     * 6. Allocate the whole rest of the pool. No class above
+     *    the request exists, so the exact class is searched.
+     * 7. Clean up.
+     * 8. The exact class is only probed so far: a gap that fits behind
+     *    nine that do not is not found.
      */
 
-    // initialize store
-    assert_int_equal(mem_init(), ALLOC_OK);
+    pool_segment_t exp0[1] =
+            {
+                    {pool->total_size, 0}
+            };
+    check_metadata(pool, TLSF, POOL_SIZE, 0, 0, 1);
+    check_pool(pool, exp0);
 
-    // allocate pools
-    for (unsigned pix=0; pix < num_pools; ++pix) {
-        // open pool
-        pools[pix] =
-                mem_pool_open(pool_size, (pix % 2) ? FIRST_FIT : BEST_FIT);
-        assert_non_null(pools[pix]);
-        // allocate pool
-        unsigned allocated = 0;
-        for (unsigned aix=0; aix < num_allocations; ++aix) {
-            allocations[pix][aix] =
-                    mem_new_alloc(pools[pix], (aix + 1) * min_alloc_size);
-            allocated += (aix + 1) * min_alloc_size;
-            if (!allocations[pix][aix]) {
-                INFO("ASSERT WILL FAIL at pix = %u, aix = %u, allocated = %u\n", pix, aix, allocated);
-            }
-            assert_non_null(allocations[pix][aix]);
-        }
-        // delete every other allocation
-        for (unsigned aix=0; aix < num_allocations; ++aix) {
-            if (aix % 2) {
-                assert_int_equal(
-                        mem_del_alloc(pools[pix], allocations[pix][aix]),
-                        ALLOC_OK);
-                allocations[pix][aix] = NULL;
-            }
-        }
-    }
 
-    // delete pools
-    for (unsigned pix=0; pix < num_pools; ++pix) {
-        // delete pool's allocations
-        for (unsigned aix=0; aix < num_allocations; ++aix) {
-            if (allocations[pix][aix]) {
-                // delete allocation
-                assert_int_equal(
-                    mem_del_alloc(pools[pix], allocations[pix][aix]),
-                    ALLOC_OK);
-            }
-        }
-        // close pool
-        assert_int_equal(mem_pool_close(pools[pix]), ALLOC_OK);
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    alloc_pt alloc1 = mem_new_alloc(pool, 1000);
+    assert_non_null(alloc1);
+    alloc_pt alloc2 = mem_new_alloc(pool, 10000);
+    assert_non_null(alloc2);
+
+    status = mem_del_alloc(pool, alloc1);
+    assert_int_equal(status, ALLOC_OK);
+
+
+    alloc_pt alloc3 = mem_new_alloc(pool, 500);
+    assert_non_null(alloc3);
+
+    pool_segment_t exp1[5] =
+            {
+                    {100, 1},
+                    {500, 1},
+                    {500, 0},
+                    {10000, 1},
+                    {pool->total_size - 11100, 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, TLSF, POOL_SIZE, 10600, 3, 2);
+
+
+    status = mem_del_alloc(pool, alloc0);
+    assert_int_equal(status, ALLOC_OK);
+
+    alloc_pt alloc4 = mem_new_alloc(pool, pool->total_size - 11100);
+    assert_non_null(alloc4);
+
+    pool_segment_t exp2[5] =
+            {
+                    {100, 0},
+                    {500, 1},
+                    {500, 0},
+                    {10000, 1},
+                    {pool->total_size - 11100, 1}
+            };
+    check_pool(pool, exp2);
+    check_metadata(pool, TLSF, POOL_SIZE, pool->total_size - 600, 3, 2);
+
+    assert_null(mem_new_alloc(pool, 1000));
+
+
+    // clean up
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc4), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc3), ALLOC_OK);
+
+    check_pool(pool, exp0);
+    check_metadata(pool, TLSF, POOL_SIZE, 0, 0, 1);
+
+    // 1006 and the nines 1000 share a class, the separators keep them apart
+    pool_pt probed = mem_pool_open(1006 + 16 + 9 * (1000 + 16), TLSF);
+    assert_non_null(probed);
+    alloc_pt gaps[10], separators[10];
+    for (unsigned i = 0; i < 10; ++i) {
+        gaps[i] = mem_new_alloc(probed, (i == 0) ? 1006 : 1000);
+        separators[i] = mem_new_alloc(probed, 16);
+        assert_non_null(gaps[i]);
+        assert_non_null(separators[i]);
+    }
+    for (unsigned i = 0; i < 10; ++i) {
+        assert_int_equal(mem_del_alloc(probed, gaps[i]), ALLOC_OK);
     }
+    assert_null(mem_new_alloc(probed, 1003));
+    alloc_pt fits = mem_new_alloc(probed, 1000);
+    assert_non_null(fits);
+    assert_int_equal(mem_del_alloc(probed, fits), ALLOC_OK);
+    for (unsigned i = 0; i < 10; ++i) {
+        assert_int_equal(mem_del_alloc(probed, separators[i]), ALLOC_OK);
+    }
+    assert_int_equal(mem_pool_close(probed), ALLOC_OK);
+}
 
-    // free store
+static int pool_buddy_setup(void **state) {
+    alloc_status status;
+    pool_pt pool = NULL;
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    INFO("Allocating pool of %lu bytes with policy BUDDY\n", (long) POOL_SIZE);
+    pool = mem_pool_open(POOL_SIZE, BUDDY);
+    assert_non_null(pool);
+
+    *state = pool;
+
+    return 0;
+}
+
+static void test_pool_buddy_scenario(void **state) {
+    alloc_status status;
+    pool_pt pool = *state;
+
+    /*
+     * BUDDY scenario:
+     *
+     * 1. Pool of 1000000 starts out as one block per set bit:
+     *    2^19, 2^18, 2^17, 2^16, 2^14, 2^9, 2^6.
+     * 2. Allocate 100. It is rounded up to 128 and carved out of
+     *    the 512 block, the smallest one that fits, leaving its
+     *    128 and 256 buddies behind.
+     * 3. Allocate another 100. It takes the free 128 buddy.
+     * 4. Allocate 300000. It takes the whole 2^19 block.
+     * 5. Deallocate the first 100. Its buddy is allocated,
+     *    so nothing merges.
+     * 6. Deallocate the second 100. It merges with its buddy
+     *    and then with the 256, restoring the 512 block.
+     * 7. Clean up.
+     */
+
+    pool_segment_t exp0[7] =
+            {
+                    {524288, 0},
+                    {262144, 0},
+                    {131072, 0},
+                    {65536, 0},
+                    {16384, 0},
+                    {512, 0},
+                    {64, 0}
+            };
+    check_pool(pool, exp0);
+    check_metadata(pool, BUDDY, POOL_SIZE, 0, 0, 7);
+
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    assert_in_range(alloc0->size, 128, 128);
+    assert_ptr_equal(alloc0->mem, pool->mem + 999424);
+
+    pool_segment_t exp1[9] =
+            {
+                    {524288, 0},
+                    {262144, 0},
+                    {131072, 0},
+                    {65536, 0},
+                    {16384, 0},
+                    {128, 1},
+                    {128, 0},
+                    {256, 0},
+                    {64, 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, BUDDY, POOL_SIZE, 128, 1, 8);
+
+
+    alloc_pt alloc1 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc1);
+    assert_ptr_equal(alloc1->mem, alloc0->mem + 128);
+
+    alloc_pt alloc2 = mem_new_alloc(pool, 300000);
+    assert_non_null(alloc2);
+    assert_ptr_equal(alloc2->mem, pool->mem);
+
+    pool_segment_t exp2[9] =
+            {
+                    {524288, 1},
+                    {262144, 0},
+                    {131072, 0},
+                    {65536, 0},
+                    {16384, 0},
+                    {128, 1},
+                    {128, 1},
+                    {256, 0},
+                    {64, 0}
+            };
+    check_pool(pool, exp2);
+    check_metadata(pool, BUDDY, POOL_SIZE, 524288 + 256, 3, 6);
+
+    assert_null(mem_new_alloc(pool, 300000));
+
+
+    status = mem_del_alloc(pool, alloc0);
+    assert_int_equal(status, ALLOC_OK);
+
+    pool_segment_t exp3[9] =
+            {
+                    {524288, 1},
+                    {262144, 0},
+                    {131072, 0},
+                    {65536, 0},
+                    {16384, 0},
+                    {128, 0},
+                    {128, 1},
+                    {256, 0},
+                    {64, 0}
+            };
+    check_pool(pool, exp3);
+
+
+    status = mem_del_alloc(pool, alloc1);
+    assert_int_equal(status, ALLOC_OK);
+
+    pool_segment_t exp4[7] =
+            {
+                    {524288, 1},
+                    {262144, 0},
+                    {131072, 0},
+                    {65536, 0},
+                    {16384, 0},
+                    {512, 0},
+                    {64, 0}
+            };
+    check_pool(pool, exp4);
+    check_metadata(pool, BUDDY, POOL_SIZE, 524288, 1, 6);
+
+
+    // clean up
+    status = mem_del_alloc(pool, alloc2);
+    assert_int_equal(status, ALLOC_OK);
+
+    check_pool(pool, exp0);
+    check_metadata(pool, BUDDY, POOL_SIZE, 0, 0, 7);
+}
+
+static void test_pool_slab(void **state) {
+    (void) state; /* unused */
+
+    const unsigned NUM_SLOTS = 10;
+    alloc_status status;
+
+    /*
+     * SLAB scenario:
+     *
+     * 1. Pool of 10 slots of 20 bytes, rounded up to 24.
+     * 2. Allocate 3 slots.
+     * 3. Deallocate the middle one, it becomes a gap.
+     * 4. Allocate again. The freed slot is reused first.
+     * 5. Foreign and repeated deallocations fail.
+     * 6. Fill the pool up, then clean up.
+     */
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    assert_null(mem_pool_open(POOL_SIZE, SLAB));
+
+    INFO("Allocating slab pool of %u slots of 20 bytes\n", NUM_SLOTS);
+    pool_pt pool = mem_pool_open_slab(20, NUM_SLOTS);
+    assert_non_null(pool);
+    check_metadata(pool, SLAB, 24 * NUM_SLOTS, 0, 0, 1);
+
+
+    alloc_pt allocs[10];
+    for (unsigned i = 0; i < 3; ++i) {
+        allocs[i] = mem_new_alloc(pool, 20);
+        assert_non_null(allocs[i]);
+        assert_in_range(allocs[i]->size, 24, 24);
+        assert_ptr_equal(allocs[i]->mem, pool->mem + 24 * i);
+    }
+    assert_null(mem_new_alloc(pool, 25));
+
+    pool_segment_t exp0[4] =
+            {
+                    {24, 1},
+                    {24, 1},
+                    {24, 1},
+                    {24 * 7, 0}
+            };
+    check_pool(pool, exp0);
+
+
+    status = mem_del_alloc(pool, allocs[1]);
+    assert_int_equal(status, ALLOC_OK);
+
+    pool_segment_t exp1[4] =
+            {
+                    {24, 1},
+                    {24, 0},
+                    {24, 1},
+                    {24 * 7, 0}
+            };
+    check_pool(pool, exp1);
+    check_metadata(pool, SLAB, 24 * NUM_SLOTS, 48, 2, 2);
+
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_FAIL);
+
+
+    alloc_pt reused = mem_new_alloc(pool, 8);
+    assert_ptr_equal(reused, allocs[1]);
+    check_pool(pool, exp0);
+
+
+    pool_pt other = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(other);
+    alloc_pt foreign = mem_new_alloc(other, 20);
+    assert_non_null(foreign);
+    assert_int_equal(mem_del_alloc(pool, foreign), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(other, foreign), ALLOC_OK);
+    assert_int_equal(mem_pool_close(other), ALLOC_OK);
+
+
+    for (unsigned i = 3; i < NUM_SLOTS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 20);
+        assert_non_null(allocs[i]);
+    }
+    assert_null(mem_new_alloc(pool, 20));
+    check_metadata(pool, SLAB, 24 * NUM_SLOTS, 24 * NUM_SLOTS, NUM_SLOTS, 0);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_NOT_FREED);
+
+
+    // clean up
+    for (unsigned i = 0; i < NUM_SLOTS; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    check_metadata(pool, SLAB, 24 * NUM_SLOTS, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_thread_cache(void **state) {
+    (void) state; /* unused */
+
+    alloc_status status;
+
+    /*
+     * POOL_THREAD_CACHE scenario:
+     *
+     * 1. Small requests are rounded up to a multiple of 16.
+     * 2. A freed small block is parked in the thread cache, it still
+     *    counts as an allocation and is handed out again first.
+     * 3. Freeing a cached block again fails.
+     * 4. Large requests bypass the cache.
+     * 5. Freeing a block again fails also once a flush has handed it
+     *    back to the pool, and it is handed out only once.
+     * 6. Freeing a block of another pool, or a record that merely points
+     *    into the pool, fails right away and writes nothing to it.
+     * 7. Closing the pool takes the cached blocks back.
+     */
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_flags(POOL_SIZE, FIRST_FIT, POOL_THREAD_CACHE);
+    assert_non_null(pool);
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    assert_int_equal(alloc0->size, 112);
+    alloc_pt alloc1 = mem_new_alloc(pool, 2000);
+    assert_non_null(alloc1);
+    assert_int_equal(alloc1->size, 2000);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 2112, 2, 1);
+
+    INFO("Freeing into the thread cache\n");
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 2112, 2, 1);
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_FAIL);
+
+    alloc_pt reused = mem_new_alloc(pool, 97);
+    assert_ptr_equal(reused, alloc0);
+    assert_int_equal(mem_del_alloc(pool, reused), ALLOC_OK);
+
+    INFO("Large blocks go straight back to the pool\n");
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 112, 1, 1);
+
+    INFO("Freeing a flushed block again\n");
+    alloc_pt small[3];
+    for (unsigned i = 0; i < 3; ++i) {
+        small[i] = mem_new_alloc(pool, 64);
+        assert_non_null(small[i]);
+    }
+    assert_int_equal(mem_del_alloc(pool, small[1]), ALLOC_OK);
+    for (unsigned i = 0; i < 5000; ++i) {
+        alloc_pt churn = mem_new_alloc(pool, 80);
+        assert_non_null(churn);
+        assert_int_equal(mem_del_alloc(pool, churn), ALLOC_OK);
+    }
+    assert_int_equal(mem_del_alloc(pool, small[1]), ALLOC_FAIL);
+    small[1] = mem_new_alloc(pool, 64);
+    alloc_pt twice = mem_new_alloc(pool, 64);
+    assert_non_null(small[1]);
+    assert_non_null(twice);
+    assert_ptr_not_equal(small[1]->mem, twice->mem);
+    assert_int_equal(mem_del_alloc(pool, twice), ALLOC_OK);
+    for (unsigned i = 0; i < 3; ++i) {
+        assert_int_equal(mem_del_alloc(pool, small[i]), ALLOC_OK);
+    }
+
+    INFO("Freeing a block of another pool\n");
+    pool_pt other_pool = mem_pool_open_flags(POOL_SIZE, FIRST_FIT, POOL_THREAD_CACHE);
+    assert_non_null(other_pool);
+    alloc_pt other = mem_new_alloc(other_pool, 64);
+    assert_non_null(other);
+    assert_int_equal(mem_del_alloc(pool, other), ALLOC_FAIL);
+    assert_int_equal(mem_del_alloc(other_pool, other), ALLOC_OK);
+    assert_int_equal(mem_pool_close(other_pool), ALLOC_OK);
+
+    INFO("Freeing a record that points into the pool\n");
+    alloc_t fake[16], before[16]; // room for whatever a node keeps after the record
+    memset(fake, 0x01, sizeof(fake));
+    fake[0].size = 64;
+    fake[0].mem = pool->mem;
+    memcpy(before, fake, sizeof(fake));
+    assert_int_equal(mem_del_alloc(pool, fake), ALLOC_FAIL);
+    assert_int_equal(memcmp(fake, before, sizeof(fake)), 0);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+typedef struct _remote_free {
+    pool_pt pool;
+    alloc_pt *allocs;
+    unsigned num_allocs;
+    unsigned errors;
+    alloc_pt foreign;
+    alloc_pt other; // a block of another pool
+} remote_free_t;
+
+static void *remote_free_worker(void *arg) {
+    remote_free_t *remote = (remote_free_t *) arg;
+
+    // cmocka cannot assert off the main thread, errors are counted instead
+    remote->foreign = mem_new_alloc(remote->pool, 100);
+    for (unsigned i = 0; i < remote->num_allocs; ++i) {
+        remote->errors += (mem_del_alloc(remote->pool, remote->allocs[i]) != ALLOC_OK);
+    }
+    remote->errors += (mem_del_alloc(remote->pool, remote->allocs[0]) != ALLOC_FAIL);
+    remote->errors += (mem_del_alloc(remote->pool, remote->other) != ALLOC_FAIL);
+    return NULL;
+}
+
+static void test_pool_remote_free(void **state) {
+    (void) state; /* unused */
+
+    const unsigned NUM_ALLOCS = 10;
+    alloc_status status;
+
+    /*
+     * POOL_OWNED scenario:
+     *
+     * 1. The owner allocates 10 blocks.
+     * 2. Another thread cannot allocate, but frees all 10 blocks;
+     *    freeing one of them again while it is queued fails, and so
+     *    does freeing a block of another pool.
+     * 3. The blocks still count as allocations until the owner allocates
+     *    or inspects the pool, which drains the queue and coalesces them.
+     * 4. Freeing a drained block again from another thread fails.
+     */
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    assert_null(mem_pool_open_flags(POOL_SIZE, FIRST_FIT, POOL_OWNED | POOL_THREAD_SAFE));
+    pool_pt pool = mem_pool_open_flags(POOL_SIZE, FIRST_FIT, POOL_OWNED);
+    assert_non_null(pool);
+
+    alloc_pt allocs[NUM_ALLOCS];
+    for (unsigned i = 0; i < NUM_ALLOCS; ++i) {
+        allocs[i] = mem_new_alloc(pool, 100);
+        assert_non_null(allocs[i]);
+    }
+
+    pool_pt other_pool = mem_pool_open(POOL_SIZE, FIRST_FIT);
+    assert_non_null(other_pool);
+    alloc_pt other = mem_new_alloc(other_pool, 100);
+    assert_non_null(other);
+
+    INFO("Freeing from another thread\n");
+    remote_free_t remote = { pool, allocs, NUM_ALLOCS, 0, NULL, other };
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, remote_free_worker, &remote), 0);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+    assert_int_equal(remote.errors, 0);
+    assert_null(remote.foreign);
+    assert_int_equal(pool->num_allocs, NUM_ALLOCS);
+
+    INFO("The owner drains the queue when it inspects the pool\n");
+    pool_segment_t exp[1] = { {POOL_SIZE, 0} };
+    check_pool(pool, exp);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    INFO("Freeing a drained block again from another thread\n");
+    remote = (remote_free_t) { pool, allocs, 0, 0, NULL, other };
+    assert_int_equal(pthread_create(&thread, NULL, remote_free_worker, &remote), 0);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+    assert_int_equal(remote.errors, 0);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 0, 0, 1);
+
+    INFO("The owner allocates from the coalesced pool\n");
+    alloc_pt alloc = mem_new_alloc(pool, 100);
+    assert_ptr_equal(alloc->mem, pool->mem);
+    check_metadata(pool, FIRST_FIT, POOL_SIZE, 100, 1, 1);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+
+    assert_int_equal(mem_del_alloc(other_pool, other), ALLOC_OK);
+    assert_int_equal(mem_pool_close(other_pool), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_slab_lock_free(void **state) {
+    (void) state; /* unused */
+
+    alloc_status status;
+
+    /*
+     * Lock-free SLAB scenario:
+     *
+     * 1. Pool of 4 slots of 20 bytes, rounded up to 24. Every free slot
+     *    is a gap of its own.
+     * 2. Allocate all 4 slots, lowest first.
+     * 3. Free two of them; repeated deallocations fail.
+     * 4. The slot freed last is handed out first.
+     */
+
+    status = mem_init();
+    assert_int_equal(status, ALLOC_OK);
+
+    assert_null(mem_pool_open_slab_flags(20, 4, POOL_THREAD_CACHE));
+    pool_pt pool = mem_pool_open_slab_flags(20, 4, POOL_THREAD_SAFE);
+    assert_non_null(pool);
+    check_metadata(pool, SLAB, 96, 0, 0, 4);
+
+    alloc_pt allocs[4];
+    for (unsigned i = 0; i < 4; ++i) {
+        allocs[i] = mem_new_alloc(pool, 20);
+        assert_non_null(allocs[i]);
+        assert_ptr_equal(allocs[i]->mem, pool->mem + 24 * i);
+    }
+    assert_null(mem_new_alloc(pool, 20));
+    check_metadata(pool, SLAB, 96, 96, 4, 0);
+
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_FAIL);
+
+    pool_segment_t exp[4] =
+            {
+                    {24, 1},
+                    {24, 0},
+                    {24, 0},
+                    {24, 1}
+            };
+    check_pool(pool, exp);
+    check_metadata(pool, SLAB, 96, 48, 2, 2);
+
+    assert_ptr_equal(mem_new_alloc(pool, 8), allocs[2]);
+
+    for (unsigned i = 0; i < 4; ++i) {
+        if (i != 1) {
+            assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+        }
+    }
+    check_metadata(pool, SLAB, 96, 0, 0, 4);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+typedef struct _sharded_churn {
+    pool_pt pool;
+    unsigned rounds;
+    unsigned errors;
+} sharded_churn_t;
+
+static void *sharded_churn_worker(void *arg) {
+    sharded_churn_t *churn = (sharded_churn_t *) arg;
+
+    // cmocka cannot assert off the main thread, errors are counted instead
+    for (unsigned i = 0; i < churn->rounds; ++i) {
+        alloc_pt allocs[8];
+        for (unsigned j = 0; j < 8; ++j) {
+            allocs[j] = mem_new_alloc(churn->pool, 16);
+            churn->errors += (allocs[j] == NULL);
+        }
+        for (unsigned j = 0; j < 8; ++j) {
+            churn->errors += (allocs[j] != NULL && mem_del_alloc(churn->pool, allocs[j]) != ALLOC_OK);
+        }
+        // larger than a shard, it may or may not find room across borders
+        alloc_pt large = mem_new_alloc(churn->pool, 1500);
+        churn->errors += (large != NULL && mem_del_alloc(churn->pool, large) != ALLOC_OK);
+    }
+    return NULL;
+}
+
+static void test_pool_sharded(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Sharded scenario:
+     *
+     * 1. FIRST_FIT pool of 4000 bytes in 4 shards of 1000 bytes.
+     * 2. Allocate 600 bytes; it comes from this thread's home shard.
+     * 3. Allocate 600 bytes more; the home shard is too full, so the
+     *    next shard serves it.
+     * 4. The metadata and the segments add up over the shards.
+     * 5. 1001 bytes fit in no shard but in the free memory across a
+     *    border.
+     * 6. Segments listed while other threads allocate still tile the
+     *    pool.
+     * 7. A pool of 4 shards of 16 KiB serves 20000 bytes, then 40000
+     *    more, taking shards over whole, then the whole pool once it is
+     *    free again.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    assert_null(mem_pool_open_sharded(4000, SLAB, 4));
+    assert_null(mem_pool_open_sharded(4000, FIRST_FIT, 0));
+    pool_pt pool = mem_pool_open_sharded(4000, FIRST_FIT, 4);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, 4000, 0, 0, 4);
+
+    alloc_pt home = mem_new_alloc(pool, 600);
+    assert_non_null(home);
+    unsigned shard = (unsigned) ((home->mem - pool->mem) / 1000);
+    assert_ptr_equal(home->mem, pool->mem + 1000 * shard);
+
+    alloc_pt stolen = mem_new_alloc(pool, 600);
+    assert_non_null(stolen);
+    assert_ptr_equal(stolen->mem, pool->mem + 1000 * ((shard + 1) % 4));
+    check_metadata(pool, FIRST_FIT, 4000, 1200, 2, 4);
+
+    pool_segment_t exp[6];
+    unsigned num = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+        if (i == shard || i == (shard + 1) % 4) {
+            exp[num++] = (pool_segment_t) {600, 1};
+            exp[num++] = (pool_segment_t) {400, 0};
+        } else {
+            exp[num++] = (pool_segment_t) {1000, 0};
+        }
+    }
+    check_pool(pool, exp);
+
+    alloc_pt joined = mem_new_alloc(pool, 1001);
+    assert_non_null(joined);
+    assert_int_equal(pool->alloc_size, 2201);
+    assert_int_equal(pool->num_allocs, 3);
+    assert_int_equal(mem_del_alloc(pool, joined), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, stolen), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, home), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, joined), ALLOC_FAIL);
+    assert_int_equal(pool->alloc_size, 0);
+    assert_int_equal(pool->num_allocs, 0);
+
+    sharded_churn_t churns[2] = { { pool, 20000, 0 }, { pool, 20000, 0 } };
+    pthread_t threads[2];
+    for (unsigned t = 0; t < 2; ++t) {
+        assert_int_equal(pthread_create(&threads[t], NULL, sharded_churn_worker, &churns[t]), 0);
+    }
+    for (unsigned i = 0; i < 20000; ++i) {
+        pool_segment_pt segs = NULL;
+        unsigned num_segs = 0;
+        mem_inspect_pool(pool, &segs, &num_segs);
+        size_t total = 0;
+        for (unsigned j = 0; j < num_segs; ++j) {
+            total += segs[j].size;
+        }
+        assert_int_equal(total, 4000);
+        free(segs);
+    }
+    for (unsigned t = 0; t < 2; ++t) {
+        assert_int_equal(pthread_join(threads[t], NULL), 0);
+        assert_int_equal(churns[t].errors, 0);
+    }
+    assert_int_equal(pool->alloc_size, 0);
+    assert_int_equal(pool->num_allocs, 0);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_sharded(65536, FIRST_FIT, 4);
+    assert_non_null(pool);
+    alloc_pt first = mem_new_alloc(pool, 20000);
+    assert_non_null(first);
+    assert_ptr_equal(first->mem, pool->mem);
+    pool_segment_t exp_first[4] =
+            {
+                    {20000, 1},
+                    {12768, 0},
+                    {16384, 0},
+                    {16384, 0}
+            };
+    check_pool(pool, exp_first);
+    check_metadata(pool, FIRST_FIT, 65536, 20000, 1, 3);
+
+    alloc_pt second = mem_new_alloc(pool, 40000);
+    assert_non_null(second);
+    assert_ptr_equal(second->mem, pool->mem + 20000);
+    pool_segment_t exp_second[3] =
+            {
+                    {20000, 1},
+                    {40000, 1},
+                    {5536, 0}
+            };
+    check_pool(pool, exp_second);
+    check_metadata(pool, FIRST_FIT, 65536, 60000, 2, 1);
+
+    assert_int_equal(mem_del_alloc(pool, first), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, second), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, 65536, 0, 0, 3);
+    assert_null(mem_new_alloc(pool, 65537));
+    alloc_pt whole = mem_new_alloc(pool, 65536);
+    assert_non_null(whole);
+    assert_ptr_equal(whole->mem, pool->mem);
+    check_metadata(pool, FIRST_FIT, 65536, 65536, 1, 0);
+    assert_int_equal(mem_del_alloc(pool, whole), ALLOC_OK);
+    pool_segment_t exp_whole[1] = { {65536, 0} };
+    check_pool(pool, exp_whole);
+    check_metadata(pool, FIRST_FIT, 65536, 0, 0, 1);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_alloc_batch(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Batch allocation scenario:
+     *
+     * 1. FIRST_FIT pool of 1000 bytes; a batch of 100, 200, 300 is laid
+     *    out back to back in the order asked for.
+     * 2. Free the 200; a batch of 150 and 350 fits in no single gap and
+     *    is served block by block.
+     * 3. A batch that does not fit as a whole fails and leaves the pool
+     *    as it was.
+     * 4. BUDDY pools, which cannot carve runs, still take batches.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(1000, FIRST_FIT);
+    assert_non_null(pool);
+
+    const size_t sizes[] = { 100, 200, 300 };
+    alloc_pt allocs[3];
+    assert_int_equal(mem_new_alloc_batch(pool, sizes, allocs, 0), ALLOC_OK);
+    assert_int_equal(mem_new_alloc_batch(pool, sizes, allocs, 3), ALLOC_OK);
+    assert_ptr_equal(allocs[0]->mem, pool->mem);
+    assert_ptr_equal(allocs[1]->mem, pool->mem + 100);
+    assert_ptr_equal(allocs[2]->mem, pool->mem + 300);
+    check_metadata(pool, FIRST_FIT, 1000, 600, 3, 1);
+
+    assert_int_equal(mem_del_alloc(pool, allocs[1]), ALLOC_OK);
+
+    const size_t split_sizes[] = { 150, 350 };
+    alloc_pt split_allocs[2];
+    assert_int_equal(mem_new_alloc_batch(pool, split_sizes, split_allocs, 2), ALLOC_OK);
+    assert_ptr_equal(split_allocs[0]->mem, pool->mem + 100);
+    assert_ptr_equal(split_allocs[1]->mem, pool->mem + 600);
+
+    pool_segment_t exp[6] =
+            {
+                    {100, 1},
+                    {150, 1},
+                    {50, 0},
+                    {300, 1},
+                    {350, 1},
+                    {50, 0}
+            };
+    check_pool(pool, exp);
+    check_metadata(pool, FIRST_FIT, 1000, 900, 4, 2);
+
+    const size_t big_sizes[] = { 50, 50, 1 };
+    alloc_pt big_allocs[3];
+    assert_int_equal(mem_new_alloc_batch(pool, big_sizes, big_allocs, 3), ALLOC_FAIL);
+    assert_null(big_allocs[0]);
+    assert_null(big_allocs[1]);
+    assert_null(big_allocs[2]);
+    check_pool(pool, exp);
+    check_metadata(pool, FIRST_FIT, 1000, 900, 4, 2);
+
+    assert_int_equal(mem_del_alloc(pool, allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, allocs[2]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, split_allocs[0]), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, split_allocs[1]), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, 1000, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(1024, BUDDY);
+    assert_non_null(pool);
+    assert_int_equal(mem_new_alloc_batch(pool, sizes, allocs, 3), ALLOC_OK);
+    check_metadata(pool, BUDDY, 1024, 128 + 256 + 512, 3, 1);
+    for (unsigned i = 0; i < 3; ++i) {
+        assert_int_equal(mem_del_alloc(pool, allocs[i]), ALLOC_OK);
+    }
+    check_metadata(pool, BUDDY, 1024, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_del_alloc_batch(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Batch deallocation scenario:
+     *
+     * 1. FIRST_FIT pool of 1000 bytes, filled with 10 allocations of 100.
+     * 2. Free 7, 2, 3, 9 and 1 in one batch that also holds a repeat; the
+     *    batch fails but frees the live ones, and 1-3 merge into one gap.
+     * 3. Free the rest in one batch; everything merges into one gap.
+     * 4. BEST_FIT and BUDDY pools come out of batches of every other
+     *    allocation whole.
+     */
+
+    const alloc_policy policies[] = { FIRST_FIT, BEST_FIT, BUDDY };
+    const size_t sizes[10] = { 100, 100, 100, 100, 100, 100, 100, 100, 100, 100 };
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(1000, FIRST_FIT);
+    assert_non_null(pool);
+    alloc_pt allocs[10];
+    assert_int_equal(mem_new_alloc_batch(pool, sizes, allocs, 10), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, 1000, 1000, 10, 0);
+
+    alloc_pt first[6] = { allocs[7], allocs[2], allocs[3], allocs[9], allocs[1], allocs[2] };
+    assert_int_equal(mem_del_alloc_batch(pool, first, 0), ALLOC_OK);
+    assert_int_equal(mem_del_alloc_batch(pool, first, 6), ALLOC_FAIL);
+
+    pool_segment_t exp[8] =
+            {
+                    {100, 1},
+                    {300, 0},
+                    {100, 1},
+                    {100, 1},
+                    {100, 1},
+                    {100, 0},
+                    {100, 1},
+                    {100, 0}
+            };
+    check_pool(pool, exp);
+    check_metadata(pool, FIRST_FIT, 1000, 500, 5, 3);
+
+    alloc_pt rest[5] = { allocs[8], allocs[0], allocs[5], allocs[4], allocs[6] };
+    assert_int_equal(mem_del_alloc_batch(pool, rest, 5), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, 1000, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    for (unsigned p = 1; p < 3; ++p) {
+        pool = mem_pool_open(1024, policies[p]);
+        assert_non_null(pool);
+        assert_int_equal(mem_new_alloc_batch(pool, sizes, allocs, 8), ALLOC_OK);
+        alloc_pt odd[4] = { allocs[7], allocs[1], allocs[5], allocs[3] };
+        alloc_pt even[4] = { allocs[2], allocs[0], allocs[6], allocs[4] };
+        assert_int_equal(mem_del_alloc_batch(pool, odd, 4), ALLOC_OK);
+        check_metadata(pool, policies[p], 1024, (p == 2) ? 512 : 400, 4, 4);
+        assert_int_equal(mem_del_alloc_batch(pool, even, 4), ALLOC_OK);
+        check_metadata(pool, policies[p], 1024, 0, 0, 1);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_realloc(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Reallocation scenario:
+     *
+     * 1. FIRST_FIT pool of 1000 bytes with allocations A (100) and B (200).
+     * 2. B grows to 300 and shrinks to 150 in place, moving the gap.
+     * 3. A shrinks to 50, which leaves a gap between A and B, then grows
+     *    back to 100, which uses that gap up.
+     * 4. A grows to 200, which does not fit in place; it moves behind B
+     *    with its contents, and its old place becomes a gap.
+     * 5. Requests that fit nowhere, and foreign allocations, fail.
+     * 6. A slab slot takes any size up to the slot size.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(1000, FIRST_FIT);
+    assert_non_null(pool);
+    alloc_pt a = mem_new_alloc(pool, 100);
+    alloc_pt b = mem_new_alloc(pool, 200);
+    assert_non_null(a);
+    assert_non_null(b);
+    for (unsigned i = 0; i < 100; ++i) {
+        a->mem[i] = (char) i;
+    }
+
+    assert_ptr_equal(mem_realloc_alloc(pool, b, 300), b);
+    check_metadata(pool, FIRST_FIT, 1000, 400, 2, 1);
+    assert_ptr_equal(mem_realloc_alloc(pool, b, 150), b);
+    check_metadata(pool, FIRST_FIT, 1000, 250, 2, 1);
+
+    assert_ptr_equal(mem_realloc_alloc(pool, a, 50), a);
+    pool_segment_t exp_shrunk[4] =
+            {
+                    {50, 1},
+                    {50, 0},
+                    {150, 1},
+                    {750, 0}
+            };
+    check_pool(pool, exp_shrunk);
+    check_metadata(pool, FIRST_FIT, 1000, 200, 2, 2);
+    assert_ptr_equal(mem_realloc_alloc(pool, a, 100), a);
+    check_metadata(pool, FIRST_FIT, 1000, 250, 2, 1);
+
+    alloc_pt moved = mem_realloc_alloc(pool, a, 200);
+    assert_non_null(moved);
+    assert_ptr_equal(moved->mem, pool->mem + 250);
+    for (unsigned i = 0; i < 50; ++i) {
+        assert_int_equal(moved->mem[i], (char) i);
+    }
+    pool_segment_t exp_moved[4] =
+            {
+                    {100, 0},
+                    {150, 1},
+                    {200, 1},
+                    {550, 0}
+            };
+    check_pool(pool, exp_moved);
+    check_metadata(pool, FIRST_FIT, 1000, 350, 2, 2);
+
+    assert_null(mem_realloc_alloc(pool, b, 2000));
+    assert_null(mem_realloc_alloc(pool, a, 10));
+    check_metadata(pool, FIRST_FIT, 1000, 350, 2, 2);
+
+    assert_int_equal(mem_del_alloc(pool, b), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, moved), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_slab(24, 2);
+    assert_non_null(pool);
+    a = mem_new_alloc(pool, 24);
+    assert_non_null(a);
+    assert_ptr_equal(mem_realloc_alloc(pool, a, 8), a);
+    assert_null(mem_realloc_alloc(pool, a, 32));
+    check_metadata(pool, SLAB, 48, 24, 1, 1);
+    assert_int_equal(mem_del_alloc(pool, a), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_alloc_aligned(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Aligned allocation scenario, FIRST_FIT, BEST_FIT and TLSF:
+     *
+     * 1. Pool of 16384 bytes; allocate 10 bytes, so the gap after it is
+     *    not 64-byte aligned.
+     * 2. Allocate 100 bytes aligned to 64; the padding before it becomes
+     *    a gap of its own.
+     * 3. Allocate 100 bytes aligned to 4096.
+     * 4. Alignments that are not powers of two are rejected.
+     * 5. Freeing everything merges the pool back into one gap.
+     */
+
+    const alloc_policy policies[] = { FIRST_FIT, BEST_FIT, TLSF };
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned p = 0; p < 3; ++p) {
+        pool_pt pool = mem_pool_open(16384, policies[p]);
+        assert_non_null(pool);
+
+        alloc_pt small = mem_new_alloc(pool, 10);
+        assert_non_null(small);
+        assert_ptr_equal(small->mem, pool->mem);
+
+        alloc_pt line = mem_new_alloc_aligned(pool, 100, 64);
+        assert_non_null(line);
+        assert_int_equal((uintptr_t) line->mem % 64, 0);
+        size_t pad = (size_t) (line->mem - pool->mem) - 10;
+        assert_true(pad > 0 && pad < 64);
+        check_metadata(pool, policies[p], 16384, 110, 2, 2);
+
+        pool_segment_t exp[4] =
+                {
+                        {10, 1},
+                        {pad, 0},
+                        {100, 1},
+                        {16384 - 110 - pad, 0}
+                };
+        check_pool(pool, exp);
+
+        alloc_pt page = mem_new_alloc_aligned(pool, 100, 4096);
+        assert_non_null(page);
+        assert_int_equal((uintptr_t) page->mem % 4096, 0);
+        check_metadata(pool, policies[p], 16384, 210, 3, 3);
+
+        assert_null(mem_new_alloc_aligned(pool, 100, 48));
+        assert_null(mem_new_alloc_aligned(pool, 100, 0));
+
+        assert_int_equal(mem_del_alloc(pool, line), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, small), ALLOC_OK);
+        assert_int_equal(mem_del_alloc(pool, page), ALLOC_OK);
+        check_metadata(pool, policies[p], 16384, 0, 0, 1);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_reserve(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Reserve/commit scenario:
+     *
+     * 1. Reserve a FIRST_FIT pool of 1 GiB; nothing is committed yet.
+     * 2. Allocate 100 bytes; the first 64 KiB are committed and usable.
+     * 3. Allocate 200000 bytes; the committed part grows past its end.
+     * 4. A block grown in place commits what it grows into.
+     * 5. Freeing everything leaves the committed part as it is.
+     */
+
+    const size_t reserved = (size_t) 1 << 30;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    assert_null(mem_pool_open_flags(reserved, FIRST_FIT, POOL_RESERVE | POOL_HUGE_PAGES));
+    assert_null(mem_pool_open_slab_flags(64, 16, POOL_RESERVE));
+
+    pool_pt pool = mem_pool_open_flags(reserved, FIRST_FIT, POOL_RESERVE);
+    assert_non_null(pool);
+    assert_int_equal(pool->committed_size, 0);
+    check_metadata(pool, FIRST_FIT, reserved, 0, 0, 1);
+
+    alloc_pt small = mem_new_alloc(pool, 100);
+    assert_non_null(small);
+    assert_int_equal(pool->committed_size % 4096, 0);
+    assert_true(pool->committed_size >= 100 && pool->committed_size < 200000);
+    memset(small->mem, 1, 100);
+
+    alloc_pt large = mem_new_alloc(pool, 200000);
+    assert_non_null(large);
+    assert_true(pool->committed_size >= 200100 && pool->committed_size < reserved);
+    memset(large->mem, 2, 200000);
+    check_metadata(pool, FIRST_FIT, reserved, 200100, 2, 1);
+
+    size_t committed = pool->committed_size;
+    assert_ptr_equal(mem_realloc_alloc(pool, large, committed), large);
+    assert_true(pool->committed_size >= committed + 100);
+    memset(large->mem, 3, committed);
+
+    committed = pool->committed_size;
+    assert_int_equal(mem_del_alloc(pool, small), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, large), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, reserved, 0, 0, 1);
+    assert_int_equal(pool->committed_size, committed);
+
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(1000, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(pool->committed_size, 1000);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_decay(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Decay scenario:
+     *
+     * 1. FIRST_FIT pool of 1 MiB; with a decay of 0 its one gap is purged
+     *    right away, all but the pages it only partly covers.
+     * 2. Allocating from the gap ends its purged state.
+     * 3. Freeing the allocation purges the merged gap again, and the
+     *    memory is still usable.
+     * 4. With a decay of a minute a fresh gap is not purged.
+     * 5. After a spike of 64 KiB blocks and a pause, a trickle of small
+     *    allocations at the edge of the big gap purges its interior.
+     * 6. mem_pool_purge purges a pool that sits unused.
+     * 7. SLAB pools cannot be purged.
+     */
+
+    const size_t pool_size = (size_t) 1 << 20;
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open(pool_size, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(pool->purged_size, 0);
+
+    assert_int_equal(mem_pool_set_decay(pool, 0), ALLOC_OK);
+    assert_true(pool->purged_size >= pool_size - 2 * 65536);
+    assert_true(pool->purged_size <= pool_size);
+    assert_int_equal(pool->purged_size % 4096, 0);
+
+    alloc_pt alloc = mem_new_alloc(pool, 100000);
+    assert_non_null(alloc);
+    memset(alloc->mem, 1, 100000);
+    assert_true(pool->purged_size <= pool_size - 100000);
+    check_metadata(pool, FIRST_FIT, pool_size, 100000, 1, 1);
+
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_true(pool->purged_size >= pool_size - 2 * 65536);
+    check_metadata(pool, FIRST_FIT, pool_size, 0, 0, 1);
+
+    alloc = mem_new_alloc(pool, pool_size);
+    assert_non_null(alloc);
+    assert_int_equal(pool->purged_size, 0);
+    memset(alloc->mem, 2, pool_size);
+
+    assert_int_equal(mem_pool_set_decay(pool, 60000), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    assert_int_equal(pool->purged_size, 0);
+
+    assert_int_equal(mem_pool_set_decay(pool, -1), ALLOC_OK);
+    assert_int_equal(mem_pool_purge(pool), ALLOC_FAIL);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    const size_t spike_size = (size_t) 4 << 20;
+    const struct timespec idle = { 0, 200 * 1000000L };
+    const struct timespec tick = { 0, 10 * 1000000L };
+    pool = mem_pool_open(spike_size, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_set_decay(pool, 50), ALLOC_OK);
+    alloc_pt spike[64];
+    for (unsigned i = 0; i < 64; ++i) {
+        spike[i] = mem_new_alloc(pool, 65536);
+        assert_non_null(spike[i]);
+        memset(spike[i]->mem, 3, 65536);
+    }
+    for (unsigned i = 0; i < 64; ++i) {
+        assert_int_equal(mem_del_alloc(pool, spike[i]), ALLOC_OK);
+    }
+    nanosleep(&idle, NULL);
+    for (unsigned i = 0; i < 20; ++i) {
+        alloc = mem_new_alloc(pool, 64);
+        assert_non_null(alloc);
+        assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+        nanosleep(&tick, NULL);
+    }
+    assert_true(pool->purged_size >= spike_size - 3 * 65536);
+
+    alloc = mem_new_alloc(pool, pool_size);
+    assert_non_null(alloc);
+    memset(alloc->mem, 4, pool_size);
+    assert_true(pool->purged_size <= spike_size - pool_size);
+    assert_int_equal(mem_del_alloc(pool, alloc), ALLOC_OK);
+    nanosleep(&idle, NULL);
+    assert_int_equal(mem_pool_purge(pool), ALLOC_OK);
+    assert_true(pool->purged_size >= spike_size - 3 * 65536);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_slab(64, 16);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_set_decay(pool, 0), ALLOC_FAIL);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+typedef struct _grown_free {
+    pool_pt pool;
+    alloc_pt alloc;
+    alloc_status status;
+} grown_free_t;
+
+static void *grown_free_worker(void *arg) {
+    grown_free_t *grown = (grown_free_t *) arg;
+
+    grown->status = mem_del_alloc(grown->pool, grown->alloc);
+    return NULL;
+}
+
+static void test_pool_growable(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * Growable scenario:
+     *
+     * 1. FIRST_FIT pool of 1000 bytes, growable up to 6000.
+     * 2. Allocate 800 twice; the second one adds a region of 1000.
+     * 3. Free both; the gaps of the two regions do not merge.
+     * 4. Allocate 1500; the pool doubles to 4000.
+     * 5. Allocating 5000 would grow past the cap and fails.
+     * 6. Batches grow the pool too; BUDDY and reserved pools cannot grow.
+     * 7. Blocks in an added region can be freed from another thread into
+     *    an owned pool, and are parked in thread caches.
+     */
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    assert_null(mem_pool_open_flags(1024, BUDDY, POOL_GROWABLE));
+    assert_null(mem_pool_open_flags(1000, FIRST_FIT, POOL_GROWABLE | POOL_RESERVE));
+
+    pool_pt fixed = mem_pool_open(1000, FIRST_FIT);
+    assert_non_null(fixed);
+    assert_int_equal(mem_pool_set_max_size(fixed, 6000), ALLOC_FAIL);
+    assert_null(mem_new_alloc(fixed, 1001));
+    assert_int_equal(mem_pool_close(fixed), ALLOC_OK);
+
+    pool_pt pool = mem_pool_open_flags(1000, FIRST_FIT, POOL_GROWABLE);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_set_max_size(pool, 999), ALLOC_FAIL);
+    assert_int_equal(mem_pool_set_max_size(pool, 6000), ALLOC_OK);
+
+    alloc_pt first = mem_new_alloc(pool, 800);
+    alloc_pt second = mem_new_alloc(pool, 800);
+    assert_non_null(first);
+    assert_non_null(second);
+    check_metadata(pool, FIRST_FIT, 2000, 1600, 2, 2);
+
+    assert_int_equal(mem_del_alloc(pool, first), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, second), ALLOC_OK);
+    pool_segment_t exp[2] =
+            {
+                    {1000, 0},
+                    {1000, 0}
+            };
+    check_pool(pool, exp);
+    check_metadata(pool, FIRST_FIT, 2000, 0, 0, 2);
+
+    alloc_pt large = mem_new_alloc(pool, 1500);
+    assert_non_null(large);
+    memset(large->mem, 1, 1500);
+    check_metadata(pool, FIRST_FIT, 4000, 1500, 1, 3);
+
+    assert_null(mem_new_alloc(pool, 5000));
+    check_metadata(pool, FIRST_FIT, 4000, 1500, 1, 3);
+
+    const size_t sizes[] = { 900, 900, 900 };
+    alloc_pt allocs[3];
+    assert_int_equal(mem_new_alloc_batch(pool, sizes, allocs, 3), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, 6000, 4200, 4, 4);
+
+    assert_int_equal(mem_del_alloc_batch(pool, allocs, 3), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, large), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, 6000, 0, 0, 4);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_flags(1024, FIRST_FIT, POOL_OWNED | POOL_GROWABLE);
+    assert_non_null(pool);
+    first = mem_new_alloc(pool, 1024);
+    second = mem_new_alloc(pool, 512);
+    assert_non_null(first);
+    assert_non_null(second);
+    grown_free_t grown = { pool, second, ALLOC_FAIL };
+    pthread_t thread;
+    assert_int_equal(pthread_create(&thread, NULL, grown_free_worker, &grown), 0);
+    assert_int_equal(pthread_join(thread, NULL), 0);
+    assert_int_equal(grown.status, ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, first), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_flags(1024, FIRST_FIT, POOL_THREAD_CACHE | POOL_GROWABLE);
+    assert_non_null(pool);
+    first = mem_new_alloc(pool, 1024);
+    second = mem_new_alloc(pool, 64);
+    assert_non_null(first);
+    assert_non_null(second);
+    assert_int_equal(mem_del_alloc(pool, second), ALLOC_OK);
+    check_metadata(pool, FIRST_FIT, 2048, 1088, 2, 1);
+    assert_ptr_equal(mem_new_alloc(pool, 64), second);
+    assert_int_equal(mem_del_alloc(pool, second), ALLOC_OK);
+    assert_int_equal(mem_del_alloc(pool, first), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_file(void **state) {
+    (void) state; /* unused */
+
+    /*
+     * File-backed scenario:
+     *
+     * 1. FIRST_FIT pool of 4096 bytes in a new, empty file.
+     * 2. Allocate 100, 200 and 50, fill the first and free the second.
+     * 3. Closing keeps the two allocations in the file.
+     * 4. Reopening with size 0 brings back the segments, and the offsets
+     *    lead to the allocations and their contents until they are freed.
+     * 5. Wrong policies, sizes and pool types are refused.
+     * 6. Once freed and closed, the file reopens as one gap.
+     * 7. A process syncs two allocations, allocates more and dies in a
+     *    sync that cannot write its table; the file reopens as of the
+     *    sync before.
+     */
+
+    char path[] = "/tmp/mem_pool_test_XXXXXX";
+    int fd = mkstemp(path);
+    assert_true(fd >= 0);
+    close(fd);
+
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    assert_null(mem_pool_open_file(path, 4096, BUDDY));
+    assert_null(mem_pool_open_file(path, 0, FIRST_FIT));
+
+    pool_pt pool = mem_pool_open_file(path, 4096, FIRST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, 4096, 0, 0, 1);
+
+    alloc_pt alloc0 = mem_new_alloc(pool, 100);
+    alloc_pt alloc1 = mem_new_alloc(pool, 200);
+    alloc_pt alloc2 = mem_new_alloc(pool, 50);
+    assert_non_null(alloc0);
+    assert_non_null(alloc1);
+    assert_non_null(alloc2);
+    strcpy(alloc0->mem, "persistent");
+    memset(alloc2->mem, 7, 50);
+    size_t offset0 = mem_alloc_offset(pool, alloc0);
+    size_t offset1 = mem_alloc_offset(pool, alloc1);
+    size_t offset2 = mem_alloc_offset(pool, alloc2);
+    assert_int_equal(offset0, 0);
+    assert_int_equal(offset2, 300);
+    assert_int_equal(mem_del_alloc(pool, alloc1), ALLOC_OK);
+    assert_int_equal(mem_pool_sync(pool), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_null(mem_pool_open_file(path, 0, BEST_FIT));
+    assert_null(mem_pool_open_file(path, 8192, FIRST_FIT));
+
+    pool = mem_pool_open_file(path, 0, FIRST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, 4096, 150, 2, 2);
+    pool_segment_t exp[4] =
+            {
+                    {100, 1},
+                    {200, 0},
+                    {50, 1},
+                    {3746, 0}
+            };
+    check_pool(pool, exp);
+
+    assert_null(mem_alloc_at(pool, offset1));
+    alloc0 = mem_alloc_at(pool, offset0);
+    alloc2 = mem_alloc_at(pool, offset2);
+    assert_non_null(alloc0);
+    assert_non_null(alloc2);
+    assert_int_equal(alloc0->size, 100);
+    assert_int_equal(alloc2->size, 50);
+    assert_int_equal(strcmp(alloc0->mem, "persistent"), 0);
+    for (unsigned i = 0; i < 50; ++i) {
+        assert_int_equal(alloc2->mem[i], 7);
+    }
+
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_null(mem_alloc_at(pool, offset0));
+    assert_int_equal(mem_del_alloc(pool, alloc2), ALLOC_OK);
+    assert_null(mem_alloc_at(pool, offset2));
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open_file(path, 4096, FIRST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, 4096, 0, 0, 1);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pid_t pid = fork();
+    assert_true(pid >= 0);
+    if (pid == 0) {
+        // cmocka cannot assert in the child, its exit status tells
+        pool = mem_pool_open_file(path, 0, FIRST_FIT);
+        int failed = (pool == NULL);
+        for (unsigned i = 0; i < 2 && !failed; ++i) {
+            failed = (mem_new_alloc(pool, 100) == NULL);
+        }
+        failed = failed || mem_pool_sync(pool) != ALLOC_OK;
+        for (unsigned i = 0; i < 8 && !failed; ++i) {
+            failed = (mem_new_alloc(pool, 10) == NULL);
+        }
+        // the file may not grow any more, so the next table cannot be written
+        struct stat st;
+        failed = failed || stat(path, &st) != 0;
+        struct rlimit limit = { (rlim_t) st.st_size, (rlim_t) st.st_size };
+        signal(SIGXFSZ, SIG_IGN);
+        failed = failed || setrlimit(RLIMIT_FSIZE, &limit) != 0;
+        failed = failed || mem_pool_sync(pool) != ALLOC_FAIL;
+        // the pool is never closed, as in a crash
+        _exit(failed);
+    }
+    int child_status = 0;
+    assert_int_equal(waitpid(pid, &child_status, 0), pid);
+    assert_true(WIFEXITED(child_status));
+    assert_int_equal(WEXITSTATUS(child_status), 0);
+
+    pool = mem_pool_open_file(path, 0, FIRST_FIT);
+    assert_non_null(pool);
+    check_metadata(pool, FIRST_FIT, 4096, 200, 2, 1);
+    pool_segment_t exp_synced[3] =
+            {
+                    {100, 1},
+                    {100, 1},
+                    {3896, 0}
+            };
+    check_pool(pool, exp_synced);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    pool = mem_pool_open(4096, FIRST_FIT);
+    assert_non_null(pool);
+    assert_int_equal(mem_pool_sync(pool), ALLOC_FAIL);
+    alloc0 = mem_new_alloc(pool, 100);
+    assert_non_null(alloc0);
+    assert_null(mem_alloc_at(pool, mem_alloc_offset(pool, alloc0)));
+    assert_int_equal(mem_del_alloc(pool, alloc0), ALLOC_OK);
+    assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+    assert_int_equal(unlink(path), 0);
+}
+
+/*******************************************/
+/***          6. STRESS TEST             ***/
+/***                                     ***/
+/***            [benchmark]              ***/
+/***         [see NOTE below]            ***/
+/*******************************************/
+
+static void test_pool_stresstest(void **state) {
+    (void) state; /* unused */
+
+    const unsigned num_pools = 200;
+    const unsigned num_allocations = 1000;
+    const unsigned min_alloc_size = 10;
+    const unsigned pool_size =
+            (num_allocations / 2) *
+            (2 * min_alloc_size + (num_allocations - 1) * min_alloc_size);
+    assert_int_equal(pool_size, 5005000);
+
+
+    pool_pt pools[num_pools];
+    alloc_pt allocations[num_pools][num_allocations];
+
+    /*
+     * NOTE: This works because the allocation records handed
+     * out to the user never move. Allocation records are a part
+     * of the nodes, and the node heap grows by adding chunks
+     * instead of reallocating the nodes, so the alloc_pt's stay
+     * valid no matter how many nodes the pool needs.
+     */
+
+    clock_t start = clock();
+
+    /*
+     * Testing dynamic reallocation of pool structures:
+     *
+     * 1. 200 pools of 5005000 each (many pools)
+     * 2. In each pool 1000 allocations of different sizes (many allocations)
+     * 3. In each pool 500 deallocations (many gaps)
+     */
+
+    // initialize store
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    // allocate pools
+    for (unsigned pix=0; pix < num_pools; ++pix) {
+        // open pool
+        const alloc_policy policies[] = { BEST_FIT, FIRST_FIT, TLSF, NEXT_FIT };
+        pools[pix] =
+                mem_pool_open(pool_size, policies[pix % 4]);
+        assert_non_null(pools[pix]);
+        // allocate pool
+        unsigned allocated = 0;
+        for (unsigned aix=0; aix < num_allocations; ++aix) {
+            allocations[pix][aix] =
+                    mem_new_alloc(pools[pix], (aix + 1) * min_alloc_size);
+            allocated += (aix + 1) * min_alloc_size;
+            if (!allocations[pix][aix]) {
+                INFO("ASSERT WILL FAIL at pix = %u, aix = %u, allocated = %u\n", pix, aix, allocated);
+            }
+            assert_non_null(allocations[pix][aix]);
+        }
+        // delete every other allocation
+        for (unsigned aix=0; aix < num_allocations; ++aix) {
+            if (aix % 2) {
+                assert_int_equal(
+                        mem_del_alloc(pools[pix], allocations[pix][aix]),
+                        ALLOC_OK);
+                allocations[pix][aix] = NULL;
+            }
+        }
+    }
+
+    // delete pools
+    for (unsigned pix=0; pix < num_pools; ++pix) {
+        // delete pool's allocations
+        for (unsigned aix=0; aix < num_allocations; ++aix) {
+            if (allocations[pix][aix]) {
+                // delete allocation
+                assert_int_equal(
+                    mem_del_alloc(pools[pix], allocations[pix][aix]),
+                    ALLOC_OK);
+            }
+        }
+        // close pool
+        assert_int_equal(mem_pool_close(pools[pix]), ALLOC_OK);
+    }
+
+    // free store
+    assert_int_equal(mem_free(), ALLOC_OK);
+
+    INFO("%u pools x %u allocations in %.3f s\n", num_pools, num_allocations,
+         (double) (clock() - start) / CLOCKS_PER_SEC);
+}
+
+static void test_pool_policy_benchmark(void **state) {
+    (void) state; /* unused */
+
+    const alloc_policy policies[] = { FIRST_FIT, BEST_FIT, TLSF, BUDDY, NEXT_FIT };
+    const char *names[] = { "FIRST_FIT", "BEST_FIT", "TLSF", "BUDDY", "NEXT_FIT" };
+    const unsigned num_policies = sizeof(policies) / sizeof(policies[0]);
+    const unsigned num_slots = 2000;
+    const unsigned num_rounds = 200000;
+    const size_t pool_size = 1 << 22;
+
+    alloc_pt allocations[num_slots];
+
+    /*
+     * Every policy runs the same churn: a pseudo-random slot is freed if it
+     * holds an allocation and refilled with a pseudo-random size otherwise.
+     * Requests the pool cannot serve are counted, not asserted, so the
+     * fragmentation each policy leaves behind shows up next to its time.
+     */
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned pix = 0; pix < num_policies; ++pix) {
+        pool_pt pool = mem_pool_open(pool_size, policies[pix]);
+        assert_non_null(pool);
+        for (unsigned six = 0; six < num_slots; ++six) {
+            allocations[six] = NULL;
+        }
+
+        unsigned long long seed = 42;
+        unsigned failed = 0;
+        clock_t start = clock();
+        for (unsigned r = 0; r < num_rounds; ++r) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            unsigned six = (unsigned) (seed >> 33) % num_slots;
+            if (allocations[six]) {
+                assert_int_equal(mem_del_alloc(pool, allocations[six]), ALLOC_OK);
+                allocations[six] = NULL;
+            } else {
+                size_t size = 16 + (size_t) (seed >> 45) % 8192;
+                allocations[six] = mem_new_alloc(pool, size);
+                failed += (allocations[six] == NULL);
+            }
+        }
+        double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+        for (unsigned six = 0; six < num_slots; ++six) {
+            if (allocations[six]) {
+                assert_int_equal(mem_del_alloc(pool, allocations[six]), ALLOC_OK);
+            }
+        }
+        assert_int_equal(pool->num_gaps, 1);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+        INFO("%-9s %u rounds in %.3f s, %u requests failed\n",
+             names[pix], num_rounds, seconds, failed);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+#define THREAD_BENCH_SLOTS 256
+
+typedef struct _thread_bench {
+    pool_pt pool;
+    unsigned rounds;
+    unsigned long long seed;
+    size_t fixed_size; // 0: random sizes
+    unsigned errors;
+} thread_bench_t;
+
+static void *thread_bench_worker(void *arg) {
+    thread_bench_t *bench = (thread_bench_t *) arg;
+    alloc_pt allocations[THREAD_BENCH_SLOTS] = { NULL };
+    const char marker = (char) bench->seed; // the seeds tell the threads apart
+
+    // cmocka cannot assert off the main thread, errors are counted instead
+    for (unsigned r = 0; r < bench->rounds; ++r) {
+        bench->seed = bench->seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        unsigned six = (unsigned) (bench->seed >> 33) % THREAD_BENCH_SLOTS;
+        if (allocations[six]) {
+            // a block handed out twice would have been overwritten
+            bench->errors += (allocations[six]->mem[0] != marker);
+            bench->errors += (mem_del_alloc(bench->pool, allocations[six]) != ALLOC_OK);
+            allocations[six] = NULL;
+        } else {
+            size_t size = bench->fixed_size ? bench->fixed_size : 16 + (size_t) (bench->seed >> 45) % 1024;
+            allocations[six] = mem_new_alloc(bench->pool, size);
+            bench->errors += (allocations[six] == NULL);
+            if (allocations[six]) {
+                allocations[six]->mem[0] = marker;
+            }
+        }
+    }
+    for (unsigned six = 0; six < THREAD_BENCH_SLOTS; ++six) {
+        if (allocations[six]) {
+            bench->errors += (mem_del_alloc(bench->pool, allocations[six]) != ALLOC_OK);
+        }
+    }
+    return NULL;
+}
+
+static void test_pool_thread_benchmark(void **state) {
+    (void) state; /* unused */
+
+    const unsigned max_threads = 8;
+    const unsigned rounds = 100000;
+
+    const unsigned slab_slots = max_threads * THREAD_BENCH_SLOTS;
+    const unsigned modes[] = { POOL_THREAD_SAFE, POOL_THREAD_CACHE, POOL_THREAD_SAFE, 0 };
+    const char *mode_names[] = { "locked", "cached", "lock-free slab", "sharded" };
+
+    /*
+     * 1..max_threads threads share one pool, each churning its own
+     * allocations, first through the pool lock only, then with thread
+     * caches in front of it, then of fixed-size records in a lock-free
+     * slab pool, then in a pool with a shard per thread. The pool must
+     * come out of it unfragmented.
+     */
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    for (unsigned mix = 0; mix < 4; ++mix)
+    for (unsigned num_threads = 1; num_threads <= max_threads; num_threads *= 2) {
+        int slab = (mix == 2);
+        int sharded = (mix == 3);
+        pool_pt pool = slab ? mem_pool_open_slab_flags(64, slab_slots, modes[mix])
+                     : sharded ? mem_pool_open_sharded(1 << 24, TLSF, max_threads)
+                               : mem_pool_open_flags(1 << 24, TLSF, modes[mix]);
+        assert_non_null(pool);
+
+        pthread_t threads[max_threads];
+        thread_bench_t benches[max_threads];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (unsigned t = 0; t < num_threads; ++t) {
+            benches[t] = (thread_bench_t) { pool, rounds, t + 1, slab ? 64 : 0, 0 };
+            assert_int_equal(pthread_create(&threads[t], NULL, thread_bench_worker, &benches[t]), 0);
+        }
+        for (unsigned t = 0; t < num_threads; ++t) {
+            assert_int_equal(pthread_join(threads[t], NULL), 0);
+            assert_int_equal(benches[t].errors, 0);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        assert_int_equal(pool->num_allocs, 0);
+        assert_int_equal(pool->alloc_size, 0);
+        assert_int_equal(pool->num_gaps, slab ? slab_slots : sharded ? max_threads : 1);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+        INFO("%s, %u thread(s): %.2f M ops/s\n", mode_names[mix], num_threads,
+             num_threads * rounds / seconds / 1e6);
+    }
+
+    assert_int_equal(mem_free(), ALLOC_OK);
+}
+
+static void test_pool_huge_page_benchmark(void **state) {
+    (void) state; /* unused */
+
+    const unsigned modes[] = { 0, POOL_HUGE_PAGES };
+    const char *names[] = { "malloc", "huge pages" };
+    const size_t pool_size = (size_t) 1 << 26;
+    const size_t block_size = 4032;
+    const unsigned num_blocks = (unsigned) (pool_size / 4096);
+    const unsigned num_accesses = 4000000;
+
+    /*
+     * The pool is carved into blocks just under a page each, all of them
+     * touched once, then read and written at pseudo-random blocks and
+     * offsets. Nearly every access lands on another page, which makes the
+     * loop bound by TLB misses on small pages.
+     */
+    assert_int_equal(mem_init(), ALLOC_OK);
+
+    alloc_pt *allocations = calloc(num_blocks, sizeof(alloc_pt));
+    assert_non_null(allocations);
+
+    for (unsigned mix = 0; mix < 2; ++mix) {
+        pool_pt pool = mem_pool_open_flags(pool_size, FIRST_FIT, modes[mix]);
+        assert_non_null(pool);
+        if (modes[mix] & POOL_HUGE_PAGES) {
+            assert_int_equal((uintptr_t) pool->mem % ((size_t) 2 << 20), 0);
+        }
+        for (unsigned bix = 0; bix < num_blocks; ++bix) {
+            allocations[bix] = mem_new_alloc(pool, block_size);
+            assert_non_null(allocations[bix]);
+            allocations[bix]->mem[0] = 0;
+        }
+
+        unsigned long long seed = 42;
+        unsigned sum = 0;
+        clock_t start = clock();
+        for (unsigned a = 0; a < num_accesses; ++a) {
+            seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+            char *mem = allocations[(seed >> 33) % num_blocks]->mem;
+            size_t offset = (size_t) (seed >> 20) % block_size;
+            sum += (unsigned char) mem[offset]++;
+        }
+        double seconds = (double) (clock() - start) / CLOCKS_PER_SEC;
+
+        assert_int_equal(mem_del_alloc_batch(pool, allocations, num_blocks), ALLOC_OK);
+        check_metadata(pool, FIRST_FIT, pool_size, 0, 0, 1);
+        assert_int_equal(mem_pool_close(pool), ALLOC_OK);
+
+        INFO("%-10s: %.2f M accesses/s (checksum %u)\n", names[mix],
+             num_accesses / seconds / 1e6, sum);
+    }
+
+    free(allocations);
     assert_int_equal(mem_free(), ALLOC_OK);
 }
 
 
 /*******************************************/
-/***         6. DRIVER ROUTINE           ***/
+/***         7. DRIVER ROUTINE           ***/
 /*******************************************/
 
 int run_test_suite() {
@@ -2417,6 +4244,8 @@ int run_test_suite() {
             cmocka_unit_test(test_pool_smoketest),
 
             cmocka_unit_test(test_pool_nonempty),
+            cmocka_unit_test(test_pool_foreign_alloc),
+            cmocka_unit_test(test_pool_store_close_then_free),
 
             cmocka_unit_test_setup_teardown(test_pool_ff_metadata, pool_ff_setup, pool_ff_teardown),
             cmocka_unit_test_setup_teardown(test_pool_bf_metadata, pool_bf_setup, pool_bf_teardown),
@@ -2443,14 +4272,32 @@ int run_test_suite() {
             cmocka_unit_test_setup_teardown(test_pool_scenario18, pool_bf_setup, pool_bf_teardown),
             cmocka_unit_test_setup_teardown(test_pool_scenario19, pool_bf_setup, pool_bf_teardown),
 
-            // do not uncomment until the project is changed to return the allocation address
-//            cmocka_unit_test(test_pool_stresstest),
+            cmocka_unit_test_setup_teardown(test_pool_nf_scenario, pool_nf_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_tlsf_scenario, pool_tlsf_setup, pool_ff_teardown),
+            cmocka_unit_test_setup_teardown(test_pool_buddy_scenario, pool_buddy_setup, pool_ff_teardown),
+            cmocka_unit_test(test_pool_slab),
+            cmocka_unit_test(test_pool_slab_lock_free),
+            cmocka_unit_test(test_pool_sharded),
+            cmocka_unit_test(test_pool_alloc_batch),
+            cmocka_unit_test(test_pool_del_alloc_batch),
+            cmocka_unit_test(test_pool_realloc),
+            cmocka_unit_test(test_pool_alloc_aligned),
+            cmocka_unit_test(test_pool_reserve),
+            cmocka_unit_test(test_pool_decay),
+            cmocka_unit_test(test_pool_growable),
+            cmocka_unit_test(test_pool_file),
+            cmocka_unit_test(test_pool_thread_cache),
+            cmocka_unit_test(test_pool_remote_free),
+
+            cmocka_unit_test(test_pool_stresstest),
+            cmocka_unit_test(test_pool_policy_benchmark),
+            cmocka_unit_test(test_pool_thread_benchmark),
+            cmocka_unit_test(test_pool_huge_page_benchmark),
     };
 
     return cmocka_run_group_tests_name("pool_test_suite", tests, NULL, NULL);
 }
 
 /* future editions */
-// TODO stress test: many pools, many allocations, many gaps (requires project refactoring, see NOTE in test body)
 // TODO test memory leaks: any way to do it w/o having to rewrite the source file?
 // TODO fix the final PASSED line of std::cerr output to the end of the file (?)